@@ -1,6 +1,72 @@
 #!/bin/sh
 workdir=$(cd $(dirname $0); pwd)
 TOY_COMPILER=${workdir}/toy_compiler
-${TOY_COMPILER} $1
-g++ $1.o  -o $1.out -L${workdir} -lcore_support
-rm $1.o
+#可以一次编译多个.k文件，可执行文件以第一个文件命名为$1.out
+#instrumented PGO的流程：
+#pgo=1 compiler.sh a.k 生成插桩的a.k.out，运行后得到default.profraw
+#llvm-profdata merge -o a.profdata default.profraw
+#pgo=2 profile_file=a.profdata compiler.sh a.k 按照profile优化
+#unity=1时所有文件一起编译到一个module，只生成$1.o，可以跨文件内联和优化
+OBJECTS=
+if [ "${unity}" = "1" ]; then
+	${TOY_COMPILER} "$@" || exit 1
+	OBJECTS="$1.o"
+else
+	for src in "$@"; do
+		${TOY_COMPILER} ${src} || exit 1
+		OBJECTS="${OBJECTS} ${src}.o"
+	done
+fi
+#插桩的程序需要链接LLVM的profile runtime，可用PROFILE_RT指定其路径。
+#profile runtime由-u引用的__llvm_profile_runtime拉入，与clang的链接方式一致
+PROFILE_LIBS=
+if [ "${pgo}" = "1" ]; then
+	if [ -z "${PROFILE_RT}" ]; then
+		PROFILE_RT=$(find $(llvm-config --libdir) -name "libclang_rt.profile-$(uname -m).a" 2>/dev/null | head -n 1)
+	fi
+	if [ ! -f "${PROFILE_RT}" ]; then
+		echo "can not find libclang_rt.profile, set PROFILE_RT" >&2
+		exit 1
+	fi
+	PROFILE_LIBS="-Wl,-u,__llvm_profile_runtime ${PROFILE_RT}"
+fi
+#symbol_order=1时每个文件生成.order，每行是"分数 符号"。
+#所有文件按分数从高到低合并排序(-s保持同分时的文件顺序)，去掉分数后交给lld，
+#cold函数的分数为-1，在整个程序中排在最后。
+#lld会忽略order中不存在的符号，并给出警告
+ORDER_FLAGS=
+ORDER_FILES=
+if [ "${symbol_order}" = "1" ] && [ "${thin_lto}" != "1" ]; then
+	for obj in ${OBJECTS}; do
+		[ -f "${obj%.o}.order" ] || exit 1
+		ORDER_FILES="${ORDER_FILES} ${obj%.o}.order"
+	done
+	sort -s -k1,1gr ${ORDER_FILES} | cut -d' ' -f2 > $1.out.order || exit 1
+	ORDER_FLAGS="-fuse-ld=lld -Wl,--symbol-ordering-file=$1.out.order"
+fi
+#thin_lto=1时各个.o都是bitcode，由lld做thin link和并行的backend，
+#core_operator_lto.o也是bitcode，operator可以跨文件内联，
+#core_support中native的core_operator.o因为符号已经定义，不会被拉入
+#backend的优化级别与编译时的opt_level一致，lld只支持--lto-O0到3，
+#Os/Oz(opt_level=4/5)和size_opt与clang一样使用O2，opti=0时为O0
+if [ "${thin_lto}" = "1" ]; then
+	LTO_OPT_LEVEL=${opt_level:-2}
+	if [ "${opti}" = "0" ]; then
+		LTO_OPT_LEVEL=0
+	elif [ "${LTO_OPT_LEVEL}" -gt 3 ] || [ "${size_opt}" = "1" ]; then
+		LTO_OPT_LEVEL=2
+	fi
+	${LTO_CXX:-clang++} -flto=thin -fuse-ld=lld -O${LTO_OPT_LEVEL} \
+		-Wl,--lto-O${LTO_OPT_LEVEL} \
+		-Wl,--thinlto-jobs=${THINLTO_JOBS:-$(nproc)} \
+		${OBJECTS} ${workdir}/core_operator_lto.o -o $1.out \
+		-L${workdir} -lcore_support ${PROFILE_LIBS} || exit 1
+else
+	g++ ${OBJECTS}  -o $1.out -L${workdir} -lcore_support ${PROFILE_LIBS} \
+		${ORDER_FLAGS} || exit 1
+fi
+#split_dwarf=1时调试信息在$1.dwo中，gdb调试$1.out时需要保留
+rm ${OBJECTS} ${ORDER_FILES}
+if [ -n "${ORDER_FILES}" ]; then
+	rm $1.out.order
+fi
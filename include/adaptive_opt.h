@@ -0,0 +1,73 @@
+#ifndef _ADAPTIVE_OPT_H_
+#define _ADAPTIVE_OPT_H_
+#include <map>
+#include <string>
+#include <unordered_map>
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+
+namespace toy_compiler{
+using namespace llvm;
+/*
+自适应的优化级别：LLVM的流水线对整个module使用同一个优化级别，
+这里在运行流水线之前按函数的大小和热度给函数加上属性，
+让流水线中的pass按函数调整自己的行为：
+TIER_HOT		小而热的函数(包括含有热循环的kernel)，module优化后再跑一遍
+				O3的函数级流水线和O3的循环展开。热函数通常已经被内联，
+				所以调用热函数的函数也一起运行，热循环这时在调用者中
+TIER_DEFAULT	按照opt_level正常优化
+TIER_SIZE		大而冷的函数或者超出预算的函数，加optsize和minsize，
+				内联、展开和向量化都按照代码大小决策，优化耗时也随之下降
+TIER_NONE		超出预算的巨型函数，加optnone和noinline，跳过所有优化
+
+大小是函数的IR指令数。热度优先使用profile中的计数(pgo=2/3)，
+没有profile时使用静态估计：每个调用点按所在循环的深度加权，
+再加上函数自身循环中的指令数乘以循环深度。
+没有被本module调用的函数是入口(例如main)，静态估计时不会被当作冷函数。
+预算是完整优化的函数的总指令数(热函数按两倍计)，0表示不限制。
+按照热度从高到低、大小从小到大的顺序分配预算，热的函数优先得到完整优化。
+*/
+enum adaptive_tier
+{
+	TIER_DEFAULT = 0,
+	TIER_HOT,
+	TIER_SIZE,
+	TIER_NONE,
+};
+
+struct adaptive_decision
+{
+	size_t size = 0;
+	uint64_t hotness = 0;
+	bool is_root = false;
+	//module优化后运行O3的循环流水线：热函数和调用热函数的函数
+	bool hot_loops = false;
+	adaptive_tier tier = TIER_DEFAULT;
+};
+
+class adaptive_opt_planner final
+{
+	static constexpr size_t SMALL_FUNC_SIZE = 256;
+	static constexpr size_t BIG_FUNC_SIZE = 1024;
+	static constexpr size_t HUGE_FUNC_SIZE = 4096;
+	//没有profile时，热度达到该值(例如两层循环中的调用，或者循环中的十几条指令)视为热函数
+	static constexpr uint64_t STATIC_HOT_WEIGHT = 16;
+	static constexpr uint64_t LOOP_CALL_WEIGHT = 8;
+
+	bool has_profile = false;
+	std::unordered_map<std::string, uint64_t> profile_counts;
+	void compute_static_hotness(Module& mod, FunctionAnalysisManager& FAM,
+		std::map<std::string, adaptive_decision>& decisions);
+	static void mark_hot_callers(Module& mod,
+		std::map<std::string, adaptive_decision>& decisions);
+public:
+	//pgo=2读取profdata，pgo=3读取sample profile，其他情况不读取
+	bool load_profile(int pgo, const std::string& profile_file,
+		LLVMContext& ctx);
+	std::map<std::string, adaptive_decision> plan(Module& mod,
+		FunctionAnalysisManager& FAM, size_t budget);
+	static void apply(Module& mod,
+		const std::map<std::string, adaptive_decision>& decisions);
+};
+}   // end of namespace toy_compiler
+#endif
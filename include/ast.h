@@ -96,6 +96,20 @@ public:
 	virtual ~expr_ast() {}
 };
 
+/*
+函数的副作用级别，与gcc的函数属性含义一致，按照约束从弱到强排列：
+PURITY_NOUNWIND	不会抛出异常
+PURITY_PURE			不会抛出异常且一定返回，不写内存，可以读内存
+PURITY_CONST		不会抛出异常且一定返回，不读写内存，结果只由入参决定
+*/
+enum func_purity : unsigned char
+{
+	PURITY_NONE = 0,
+	PURITY_NOUNWIND,
+	PURITY_PURE,
+	PURITY_CONST
+};
+
 /*
 逻辑上看，用户自定义的operator应该作为prototype_ast的子类来建模。
 但是由于operator的特有之处太少(就是多了一个优先级)，
@@ -112,6 +126,15 @@ class prototype_ast : public generic_ast,
 	//为支持operator增加两个字段
 	bool is_operator = false;
 	int priority_for_binary = -1;
+/*
+单个函数的fast math级别，含义与flags.def中的fast_math一致。
+-1表示跟随全局的fast_math设置，def strict设置为0，def fastmath设置为3。
+*/
+	int fast_math_level = -1;
+	//extern pure/const等修饰关键字声明的副作用级别
+	func_purity purity = PURITY_NONE;
+	//def export声明的函数在whole_program模式下仍然对外可见
+	bool is_exported = false;
 public:
 	prototype_t get_shared_ptr()  {return shared_from_this();}
 	prototype_ast(const source_location& loc, const string& name,
@@ -123,6 +146,12 @@ public:
 		{}
 	const string& get_name() const { return name; }
 	const vector<string>& get_args() const {return args;}
+	int get_fast_math_level() const {return fast_math_level;}
+	void set_fast_math_level(int level) {fast_math_level = level;}
+	func_purity get_purity() const {return purity;}
+	void set_purity(func_purity in_purity) {purity = in_purity;}
+	bool get_exported() const {return is_exported;}
+	void set_exported(bool exported) {is_exported = exported;}
 
 /*
 	由于操作符命名错误较为少见，且出错时通常会导致难以察觉的行为异常。
@@ -240,6 +269,29 @@ public:
 		expr_t LHS, expr_t RHS, const string& op_external_name)
 		: expr_ast(loc, BINARY_OPERATOR_AST), op(op), LHS(std::move(LHS)), RHS(std::move(RHS)), 
 		op_external_name(std::move(op_external_name)) {}
+/*
+很长的','序列会形成深度与语句数相同的binary树，默认的析构沿着shared_ptr
+逐层递归，可能耗尽native栈。这里把独占的binary子树摘下来逐个释放，
+被释放的节点已经没有binary子节点，析构不会继续递归。
+*/
+	~binary_operator_ast()
+	{
+		vector<expr_t> pending;
+		pending.push_back(std::move(LHS));
+		pending.push_back(std::move(RHS));
+		while (!pending.empty())
+		{
+			expr_t expr = std::move(pending.back());
+			pending.pop_back();
+			if (expr && expr.use_count() == 1
+				&& expr->get_type() == BINARY_OPERATOR_AST)
+			{
+				auto bin = static_cast<binary_operator_ast*>(expr.get());
+				pending.push_back(std::move(bin->LHS));
+				pending.push_back(std::move(bin->RHS));
+			}
+		}
+	}
 
 	static int get_priority(binary_operator_t in_op)
 	{
@@ -334,19 +386,30 @@ public:
 	const expr_vector& get_args() const {return args;}
 };
 
-//if语句的格式：IF cond_expr THEN then_expr ELSE else_expr
+//if条件的分支概率提示，由if likely/if unlikely给出
+enum branch_hint : unsigned char
+{
+	BRANCH_HINT_NONE = 0,
+	BRANCH_HINT_LIKELY,
+	BRANCH_HINT_UNLIKELY
+};
+
+//if语句的格式：IF [LIKELY|UNLIKELY] cond_expr THEN then_expr ELSE else_expr
 class if_ast : public expr_ast
 {
 	expr_t cond_expr;
 	expr_t then_expr;
 	expr_t else_expr;
+	branch_hint hint;
 public:
-	if_ast(const source_location& loc, expr_t c, expr_t t, expr_t e)
+	if_ast(const source_location& loc, expr_t c, expr_t t, expr_t e,
+		branch_hint hint = BRANCH_HINT_NONE)
 		: expr_ast(loc, IF_AST), cond_expr(std::move(c)),
-		then_expr(std::move(t)), else_expr(std::move(e)) {}
+		then_expr(std::move(t)), else_expr(std::move(e)), hint(hint) {}
 	const expr_t& get_cond() const{ return cond_expr;}
 	const expr_t& get_then() const{ return then_expr;}
 	const expr_t& get_else() const{ return else_expr;}
+	branch_hint get_hint() const{ return hint;}
 };
 
 /*
@@ -2,6 +2,8 @@
 #define _FLAGS_H_
 #include <cstdlib>
 #include <sstream>
+#include <string>
+#include <type_traits>
 /*
 为了简单，使用环境变量控制编译器行为。
 注意还未对输入值做合法性检查，后续可以callback函数形式添加
@@ -20,14 +22,17 @@ class control_flags
 			input_env(env), description(des)
 		{
 			const char *env_val = getenv(input_env);
-			if (env_val != nullptr)
+			//字符串类型取环境变量的完整值，>>会在空白处截断(如含空格的路径)
+			if (env_val == nullptr)
+				flag_val = default_val;
+			else if constexpr (is_same_v<T, string>)
+				flag_val = env_val;
+			else
 			{
 				stringstream tmp;
 				tmp << env_val;
 				tmp >> flag_val;
 			}
-			else
-				flag_val = default_val;
 		}
 		flag_item(){}
 		operator T() {return flag_val;}
@@ -0,0 +1,68 @@
+#ifndef _FUNC_ATTR_ANALYSIS_H_
+#define _FUNC_ATTR_ANALYSIS_H_
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include "ast.h"
+
+namespace toy_compiler{
+using namespace std;
+/*
+前端掌握所有def函数的函数体，可以在ast层面直接推导出函数属性，
+不必等到O2时LLVM的FunctionAttrs pass。这样函数级优化和O1也能受益。
+
+推导的属性与LLVM的函数属性对应：
+read_none/read_only		不读写/只读 函数外的内存(局部变量都在本函数栈上，不算)
+no_unwind						不会抛出异常
+no_recurse						不会直接或间接地递归调用自己
+will_return						一定会返回(没有for循环，也没有递归)
+*/
+struct func_attr
+{
+	bool read_none = false;
+	bool read_only = false;
+	bool no_unwind = false;
+	bool no_recurse = false;
+	bool will_return = false;
+};
+
+class func_attr_analysis final
+{
+	//每个def函数的摘要，由函数体遍历得出
+	struct func_summary
+	{
+		const function_ast* func = nullptr;
+		vector<string> callees;		//函数体中call的函数名(含自定义operator)
+		bool has_loop = false;
+		bool in_cycle = false;		//处于调用图的环中(含直接递归)
+		//Tarjan算法使用的临时数据
+		int dfs_index = -1;
+		int low_link = -1;
+		bool on_stack = false;
+	};
+	unordered_map<string, func_summary> defined_funcs;
+	unordered_map<string, const prototype_ast*> extern_protos;
+	unordered_map<string, func_attr> result;
+	//codegen会替换为intrinsic的extern，视为const且不会递归
+	function<bool(const prototype_ast*)> is_intrinsic;
+
+	void summarize(func_summary& summary);
+	void mark_cycles();
+	void strong_connect(func_summary& summary, int& index,
+		vector<func_summary*>& scc_stack);
+	func_attr get_callee_attr(const string& name) const;
+public:
+	void run(const ast_vector_t& global_vec,
+		function<bool(const prototype_ast*)> intrinsic_checker = nullptr);
+	//返回nullptr表示没有推导结果(例如extern或者未分析的函数)
+	const func_attr* find(const string& name) const
+	{
+		auto it = result.find(name);
+		return it != result.cend() ? &(it->second) : nullptr;
+	}
+	//extern声明的属性，与gen_prototype中发射的属性保持一致
+	static func_attr get_declared_attr(const prototype_ast* proto);
+};
+}   // end of namespace toy_compiler
+#endif
@@ -0,0 +1,53 @@
+#ifndef _IR_ATTRIBUTION_H_
+#define _IR_ATTRIBUTION_H_
+#include <map>
+#include <string>
+#include <utility>
+#include <unordered_map>
+#include "ast.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace toy_compiler{
+using namespace llvm;
+/*
+记录IR指令来自哪个AST节点，用于找出生成代码中IR膨胀和编译耗时的热点。
+codegen在发射指令时用metadata(!toy.ast)打上AST的id，
+metadata会跟随指令经过优化，优化中新建的指令没有标签，统计为unattributed。
+按行统计时优先使用调试信息中的行号(优化后保留得更完整)，
+没有调试信息时再使用标签对应AST的行号。
+unity build中一个module包含多个源文件，行号按照(文件名, 行号)区分。
+*/
+struct ast_origin
+{
+	ast_t type;
+	int64_t line;
+	int64_t col;
+	std::string file;
+};
+
+class ir_attribution final
+{
+public:
+	struct report
+	{
+		size_t total = 0;
+		size_t unattributed = 0;
+		std::map<uint64_t, size_t> per_ast;
+		std::map<std::string, size_t> per_function;
+		//key是(文件名, 行号)，行号0表示无法确定行号
+		std::map<std::pair<std::string, int64_t>, size_t> per_line;
+	};
+	static void tag(Instruction* inst, uint64_t ast_id);
+	//没有标签时返回false
+	static bool get_tag(const Instruction* inst, uint64_t& ast_id);
+	static report collect(const Module& mod,
+		const std::unordered_map<uint64_t, ast_origin>& origins);
+	//每一类统计按指令数从多到少只打印前top_n项
+	static void print(const report& rpt,
+		const std::unordered_map<uint64_t, ast_origin>& origins,
+		const std::string& title, raw_ostream& out, size_t top_n = 10);
+};
+}   // end of namespace toy_compiler
+#endif
@@ -47,6 +47,14 @@ typedef  enum token_type: unsigned char {
 	TOKEN_VAR,
 	TOKEN_USER_DEFINED_BINARY_OPERATOR,
 	TOKEN_USER_DEFINED_UNARY_OPERATOR,
+	TOKEN_STRICT,
+	TOKEN_FASTMATH,
+	TOKEN_NOUNWIND,
+	TOKEN_PURE,
+	TOKEN_CONST,
+	TOKEN_EXPORT,
+	TOKEN_LIKELY,
+	TOKEN_UNLIKELY,
 	TOKEN_EOF,
 	TOKEN_WRONG
 } token_type_t;
@@ -76,6 +84,11 @@ public:
 			return TOKEN_IF;
 		if (input == "then")
 			return TOKEN_THEN;
+		//if条件的分支概率提示
+		if (input == "likely")
+			return TOKEN_LIKELY;
+		if (input == "unlikely")
+			return TOKEN_UNLIKELY;
 		if (input == "else")
 			return TOKEN_ELSE;
 
@@ -92,6 +105,22 @@ public:
 
 		if (input == "var")
 			return TOKEN_VAR;
+
+		//函数修饰关键字，控制单个函数的浮点优化
+		if (input == "strict")
+			return TOKEN_STRICT;
+		if (input == "fastmath")
+			return TOKEN_FASTMATH;
+		//函数修饰关键字，声明函数的副作用
+		if (input == "nounwind")
+			return TOKEN_NOUNWIND;
+		if (input == "pure")
+			return TOKEN_PURE;
+		if (input == "const")
+			return TOKEN_CONST;
+		//函数修饰关键字，whole_program模式下保持函数对外可见
+		if (input == "export")
+			return TOKEN_EXPORT;
 		//关键字排除后，作为名称标识
 		return TOKEN_IDENTIFIER;
 	}
@@ -132,6 +161,20 @@ class lexer
 	*/
 	int cur_char = ' ';
 	source_location loc;
+	//释放之前打开的文件，打开失败时设置is_ok和error_msg
+	bool open_input(const std::string& filename)
+	{
+		if (input_stream != &std::cin && input_stream)
+			delete input_stream;
+		auto *fstream  = new std::ifstream;
+		//必须先赋值，否则打开失败的情况下析构无法释放fstream
+		input_stream = fstream;
+		fstream->open(filename, std::ios_base::in);
+		is_ok = fstream->is_open();
+		if (!is_ok)
+			error_msg = "can not open input file " + filename;
+		return is_ok;
+	}
 	inline int get_next_char(std::istream *in)
 	{
 		int new_char = in->get();
@@ -456,15 +499,18 @@ clang作为一个c99的扩展支持了该特性。g++直到10版本都还未支
 
 	lexer(const std::string& filename) : loc(filename)
 	{
-		auto *fstream  = new std::ifstream;
-		//必须先赋值，否则打开失败的情况下析构无法释放fstream
-		input_stream = fstream;
-		fstream->open(filename, std::ios_base::in);
-		if (!fstream->is_open())
-		{
-			error_msg = "can not open input file" + filename;
-			is_ok = false;
-		}
+		open_input(filename);
+	}
+
+/*
+unity build时多个文件共用一个lexer和parser，当前文件解析到eof后
+切换到下一个文件继续，source location中的文件名也随之更新。
+*/
+	bool open_file(const std::string& filename)
+	{
+		loc = source_location(filename);
+		cur_char = ' ';
+		return open_input(filename);
 	}
 
 	//通常情况下应该只有测试流程会用该种初始化
@@ -4,6 +4,10 @@
 #include "codegen.h"
 #include "ast.h"
 #include "flags.h" //for global_flags.debug_info
+#include "func_attr_analysis.h"
+#include "ir_attribution.h"
+#include <map>
+#include <unordered_set>
 #include "llvm/IR/Type.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
@@ -11,38 +15,148 @@
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/DIBuilder.h" //for DIBuilder
+#include "llvm/IR/Intrinsics.h" //for Intrinsic::ID
+#include "llvm/IR/MDBuilder.h" //for createBranchWeights
 #include "utils.h" /* for err_print*/
 
 namespace toy_compiler{
 using namespace llvm;
+/*
+调试信息的级别，与global_flags.debug_info的取值对应：
+DEBUG_INFO_FULL				发射行号、subprogram以及入参和局部变量的声明，调试器可以查看变量
+DEBUG_INFO_LINE_TABLES	只有行号和subprogram，足够profile符号化和backtrace
+debug_info原来是bool，为了兼容，1仍然表示完整的调试信息，只有行号的级别使用2。
+*/
+enum debug_info_level
+{
+	DEBUG_INFO_NONE = 0,
+	DEBUG_INFO_FULL = 1,
+	DEBUG_INFO_LINE_TABLES = 2,
+};
+
+/*
+unity build时一个module包含多个源文件，每个源文件对应一个DICompileUnit。
+DIBuilder只允许创建一个compile unit，所以每个源文件各有一个DIBuilder，
+在第一次遇到该文件的函数时创建。DBuilder等字段指向当前函数所在的源文件，
+由gen_function调用select_unit切换。
+函数的subroutine type只与入参个数有关，按入参个数缓存，
+避免每个函数都重新创建type array再由LLVM做uniquing。
+*/
 struct llvm_debug_info
 {
 	DIBuilder* DBuilder;
 	DICompileUnit* compile_unit;
+	DIFile* file;
 	DIType* double_type;
+	debug_info_level level;
 	std::vector<DIScope*> lexical_blocks;
 public:
-	llvm_debug_info(Module* mod, const string& source);
+	llvm_debug_info(Module* mod, const string& source, debug_info_level lv);
 	~llvm_debug_info();
+	DISubroutineType* get_subroutine_type(unsigned num_args);
+	bool is_full() const {return level == DEBUG_INFO_FULL;}
+	//无法解析路径的源文件(如标准输入)归入构造时的主文件
+	void select_unit(const string& source);
+	void finalize();
+private:
+	struct debug_unit
+	{
+		DIBuilder* builder;
+		DICompileUnit* compile_unit;
+		DIFile* file;
+		DIType* double_type;
+		std::vector<DISubroutineType*> subroutine_types;
+	};
+	Module* mod;
+	//key为源文件的canonical路径，主文件路径无法解析时key为空串
+	std::map<string, debug_unit> units;
+	debug_unit* main_unit;
+	debug_unit* cur_unit;
+	static string get_unit_key(const string& source);
+	debug_unit& create_unit(const string& key);
 };
 
 class LLVM_IR_code_generator final : public code_generator<Value *>
 {
 	LLVMContext the_context;
-	IRBuilder<> ir_builder;
+	//ir_builder插入的每条指令都会经过tag_instruction，用于ast_attribution
+	IRBuilder<ConstantFolder, IRBuilderCallbackInserter> ir_builder;
 	Module* the_module;
 	Function* cur_func = nullptr;
 	llvm_debug_info* debug_info = nullptr;
 	std::map<std::string, AllocaInst *> named_var;
+/*
+ast_attribution模式的状态：
+cur_ast			当前发射的指令所属的AST节点
+ast_origins	打过标签的AST id对应的节点信息，供报告使用
+*/
+	bool attribution = false;
+	const generic_ast* cur_ast = nullptr;
+	std::unordered_map<uint64_t, ast_origin> ast_origins;
+	void tag_instruction(Instruction* inst);
+	func_attr_analysis attr_analysis;
+/*
+尾调用相关的状态，每个函数开始生成时重置：
+tail_calls				处于尾调用位置的call_ast
+tail_recurse_bb		自递归尾调用跳回的bb，函数没有自递归尾调用时为空
+arg_allocas			入参的stack地址，自递归尾调用改为循环时写入新的入参
+*/
+	std::unordered_set<const expr_ast *> tail_calls;
+	BasicBlock* tail_recurse_bb = nullptr;
+	std::vector<AllocaInst *> arg_allocas;
+	//当前处于作用域内的var/for变量，按声明顺序排列，尾调用离开函数前要结束其lifetime
+	std::vector<AllocaInst *> scoped_allocas;
+	void emit_lifetime_start(AllocaInst* alloca);
+	void emit_lifetime_end(AllocaInst* alloca);
+	//whole_program模式且module中定义了main，由codegen在生成前确定
+	bool internalize = false;
+	void collect_tail_calls(const expr_ast* body);
+	Value* build_tail_call(const call_ast* callee, Function* callee_func,
+		ArrayRef<Value *> args_vec);
 	AllocaInst* create_alloca_at_func_entry(Function* func, 
 		const string& var_ame);
+//build_expr用显式的栈遍历表达式，操作数求值完成后由emit系列函数发射运算本身
+	static const expr_ast* get_operand(const expr_ast* expr, unsigned idx);
+	Value* emit_call(const call_ast* callee, ArrayRef<Value *> args_vec);
+	Value* emit_binary_op(const binary_operator_ast* bin,
+		ArrayRef<Value *> operands);
+	Value* emit_unary_op(const unary_operator_ast* unary,
+		ArrayRef<Value *> operands);
+/*
+core_operator库中以函数方式实现的运算。
+逻辑运算作为分支条件时，可以直接展开为i1运算，省去call和double的来回转换。
+','顺序求值总是可以直接展开，其rhs也就处于','所在的尾调用位置。
+*/
+	enum core_op_type
+	{
+		CORE_OP_NOT,
+		CORE_OP_OR,
+		CORE_OP_GREATER,
+		CORE_OP_EQUAL,
+		CORE_OP_SEQUENCE,
+		CORE_OP_UNKNOWN
+	};
+	core_op_type find_core_op(const string& op_external_name);
+	Value* build_cond(const expr_ast* cond, const source_location& loc,
+		const char* name);
+	int get_select_cost(const expr_ast* expr);
+	bool should_lower_to_select(const if_ast* if_expr);
+	MDNode* get_branch_weights(branch_hint hint);
+	void set_fast_math(const prototype_ast* proto);
+	Intrinsic::ID find_math_intrinsic(Function* func);
+	static Intrinsic::ID find_math_intrinsic(StringRef name, size_t arg_num);
 public:
 	LLVM_IR_code_generator(StringRef file_name = "unamed") 
-		: ir_builder(the_context)
+		: ir_builder(the_context, ConstantFolder(),
+			IRBuilderCallbackInserter([this] (Instruction* inst)
+				{tag_instruction(inst);})),
+		attribution(global_flags.ast_attribution)
 	{
 		the_module = new(Module)(file_name, the_context);
-		if (global_flags.debug_info)
-			debug_info = new(llvm_debug_info)(the_module, file_name.str());
+		int level = global_flags.debug_info;
+		if (level != DEBUG_INFO_NONE)
+			debug_info = new(llvm_debug_info)(the_module, file_name.str(),
+				level == DEBUG_INFO_LINE_TABLES ? DEBUG_INFO_LINE_TABLES : DEBUG_INFO_FULL);
 	}
 
 	~LLVM_IR_code_generator()
@@ -62,17 +176,21 @@ public:
 	Value* build_if(const if_ast* if_expr) override;
 	Value* build_for(const for_ast* for_expr) override;
 	Value* build_var(const var_ast* var_expr) override;
-//	bool codegen(ast_vector_t& global_vec) override;
+	bool codegen(const ast_vector_t& global_vec) override;
 
 	void print_IR() override;
 	void print_IR_to_str(string& out) override;
 	void print_IR_to_file(int fd);
 	void print_IR_to_file(string& filename);
 	Module* get_module(){return the_module;}
+	const std::unordered_map<uint64_t, ast_origin>& get_ast_origins() const
+	{
+		return ast_origins;
+	}
 	void finalize()
 	{
 		if (debug_info)
-			debug_info->DBuilder->finalize();
+			debug_info->finalize();
 	}
 	void emit_location(const source_location& log);
 };
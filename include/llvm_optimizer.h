@@ -7,18 +7,86 @@
 #include "llvm/IR/Type.h"
 #include "llvm/IR/PassManager.h"	/*for buildPerModuleDefaultPipeline*/
 #include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Target/TargetMachine.h"
 #include "utils.h" /* for err_print*/
+#include "flags.h" /* for global_flags.pgo */
+#include "adaptive_opt.h"
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
 
 namespace toy_compiler{
 using namespace llvm;
+/*
+一个llvm_optimizer对象就是一次优化会话：
+TargetMachine、PassBuilder、四个analysis manager和pass流水线只在构造时(流水线
+在第一次使用时)创建一次，之后可以反复优化多个函数和module。
+每次优化结束后清空缓存的分析结果，下一次运行不会用到过期的分析。
+PGO的设置在构造时从global_flags读取，作用于opt_level对应的默认流水线。
+逐个函数优化时，省去了每次重新创建和注册全部分析的开销。
+*/
 class llvm_optimizer final
 {
+	//llvm的优化级别分别是O0到O3，再加上Os和Oz
+	static constexpr int OPT_LEVEL_NUM = 6;
+	std::unique_ptr<TargetMachine> target_machine;
+	PassBuilder opt_builder;
+	LoopAnalysisManager LAM;
+	FunctionAnalysisManager FAM;
+	CGSCCAnalysisManager CGAM;
+	ModuleAnalysisManager MAM;
+	FunctionPassManager func_optimizer;
+	std::optional<ModulePassManager> module_optimizers[OPT_LEVEL_NUM];
+	//ThinLTO的pre-link流水线，只做函数简化，跨module的优化留给链接时
+	std::optional<ModulePassManager> thin_lto_optimizers[OPT_LEVEL_NUM];
+	//adaptive模式下热函数和它们的调用者额外运行的O3函数级流水线
+	std::optional<FunctionPassManager> hot_optimizer;
+	//按pipeline文本缓存解析出的ModulePassManager
+	std::unordered_map<std::string, ModulePassManager> custom_optimizers;
+	void clear_analyses();
+	static Optional<PGOOptions> get_pgo_options();
+public:
+	llvm_optimizer();
+	llvm_optimizer(const llvm_optimizer&) = delete;
+	llvm_optimizer& operator=(const llvm_optimizer&) = delete;
+	void optimize(Module& mod, int opt_level = 2, bool thin_lto_prelink = false);
+	void optimize(Function& func);
+	//pipeline使用opt -passes的语法，解析失败时返回false，不修改module
+	bool optimize(Module& mod, const std::string& pipeline);
+/*
+按函数的大小和热度调整优化力度，budget见adaptive_opt_planner，
+返回每个函数的决策，读取profile失败时按没有profile处理
+*/
+	std::map<std::string, adaptive_decision> optimize_adaptive(Module& mod,
+		int opt_level = 2, size_t budget = 0, bool thin_lto_prelink = false);
+/*
+体积优先的配置：所有函数加minsize后按Oz优化，再合并相同的函数。
+thin_lto_prelink时使用Oz的ThinLTO pre-link流水线，不合并函数。
+mergefunc的pipeline无法解析时返回false，此时Oz优化已经完成
+*/
+	bool optimize_size(Module& mod, bool thin_lto_prelink = false);
+	static bool is_valid_opt_level(int opt_level)
+	{
+		return 0 <= opt_level && opt_level < OPT_LEVEL_NUM;
+	}
 /*
 这里的返回值意义与llvm的optimizer对齐，新版本的PassManager不再返回bool
+下面两个接口每次调用都会新建一个会话，只适合单次使用
 */
-public:
-	static void optimize_module(Module& mod, int opt_level = 2);
+	static void optimize_module(Module& mod, int opt_level = 2,
+		bool thin_lto_prelink = false);
 	static void optimize_function(Function& func);
+	static bool optimize_module(Module& mod, const std::string& pipeline);
+/*
+把module按照调用关系划分为jobs个分区，在各自的LLVMContext中并行优化后
+按分区顺序链接回原module，结果是确定的。jobs<=1时只有一个分区，
+但仍然经过内联、分区和bitcode的往返，单线程的优化应该使用optimize_module。
+失败时返回false，此时module可能已经被修改。
+*/
+	static bool optimize_module_parallel(Module& mod, int opt_level,
+		unsigned jobs);
 };
 /*
 class MAPLE_IR_code_generator : public code_generator
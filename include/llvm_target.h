@@ -1,6 +1,7 @@
 #ifndef _LLVM_TARGET_H_
 #define _LLVM_TARGET_H_
 #include "llvm/Target/TargetMachine.h" 	//for InitializeNativeTarget...
+#include <string>
 #include "utils.h" /* for err_print*/
 
 namespace toy_compiler{
@@ -13,7 +14,12 @@ class llvm_target final
 */
 public:
 //为了简单，我们当前只支持本地机器
-	static TargetMachine* get_native_target();
+//split_dwarf_file非空时，调试信息的主体写入该.dwo文件，object中只保留skeleton
+//machine_outliner为true时，后端把重复的机器指令序列提取为公共函数
+//function_sections为true时，每个函数放在单独的section中，链接器可以调整函数顺序
+	static TargetMachine* get_native_target(
+		const string& split_dwarf_file = string(), bool machine_outliner = false,
+		bool function_sections = false);
 };
 /*
 class MAPLE_IR_code_generator : public code_generator
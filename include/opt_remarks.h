@@ -0,0 +1,64 @@
+#ifndef _OPT_REMARKS_H_
+#define _OPT_REMARKS_H_
+#include <map>
+#include <memory>
+#include <string>
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace toy_compiler{
+using namespace llvm;
+/*
+收集LLVM优化pass发出的remarks，用于查看内联、向量化等优化没有生效的原因。
+remarks有两个去向：
+1 LLVM的RemarkStreamer按照yaml或bitstream格式写入文件，可以用opt-viewer等工具查看
+2 本类安装的DiagnosticHandler在进程内统计missed和analysis两类remark，
+	按函数汇总后打印，analysis一般是missed的原因(如向量化失败的具体理由)
+remark中的源码位置来自emit_location发射的调试信息，debug_info=0时没有行号。
+一个对象对应一次编译，析构时恢复context原来的DiagnosticHandler，
+所以对象的生命周期不能超过LLVMContext。
+*/
+class opt_remarks final
+{
+public:
+	struct remark_summary
+	{
+		size_t count = 0;
+		//第一次出现的位置和内容，行号0表示没有调试信息
+		unsigned line = 0;
+		unsigned col = 0;
+		std::string message;
+	};
+	//key依次为函数名和"kind pass:name"
+	using summary_map = std::map<std::string, std::map<std::string, remark_summary>>;
+private:
+	class remark_collector;
+	LLVMContext& context;
+	std::unique_ptr<DiagnosticHandler> saved_handler;
+	std::unique_ptr<ToolOutputFile> remark_file;
+	summary_map summary;
+	size_t missed_num = 0;
+	void record(const DiagnosticInfoOptimizationBase& remark);
+public:
+/*
+file_name为空时只做进程内的统计，不写文件。
+passes是pass名字的正则表达式，为空时保留所有pass的remarks。
+format为yaml或者bitstream。
+*/
+	opt_remarks(LLVMContext& ctx);
+	~opt_remarks();
+	opt_remarks(const opt_remarks&) = delete;
+	opt_remarks& operator=(const opt_remarks&) = delete;
+	bool setup(const std::string& file_name, const std::string& passes,
+		const std::string& format, bool with_hotness);
+	const summary_map& get_summary() const {return summary;}
+	size_t get_missed_num() const {return missed_num;}
+	//每个函数按出现次数从多到少只打印前top_n项
+	void print_summary(raw_ostream& out, size_t top_n = 5) const;
+};
+}   // end of namespace toy_compiler
+#endif
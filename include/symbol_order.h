@@ -0,0 +1,42 @@
+#ifndef _SYMBOL_ORDER_H_
+#define _SYMBOL_ORDER_H_
+#include <string>
+#include <vector>
+#include "llvm/IR/Module.h"
+
+namespace toy_compiler{
+using namespace llvm;
+/*
+按照热度给函数符号排序，生成lld的--symbol-ordering-file，
+链接时热的函数被排列在一起，减少i-cache和iTLB的缺失。
+需要function_sections，每个函数在单独的section中链接器才能调整顺序。
+
+热度优先使用PGO的函数入口计数(pgo=2/3在优化中设置)，
+没有profile时做静态估计：函数的入口频率乘以函数自身按基本块频率加权的指令数。
+入口频率从没有调用者的函数(频率为1)开始，沿调用边乘以调用点的相对频率传播。
+基本块的频率来自BlockFrequencyInfo，已经包含了循环深度和likely/unlikely
+发射的branch weights。compute在优化之后调用，看到的是内联后实际的调用关系。
+带cold属性的函数和HotColdSplitting拆分出来的.cold函数总是排在最后，
+它们的分数是COLD_SCORE，低于所有非cold的函数。
+
+多个文件分别编译时，compiler.sh把各个文件的结果按分数合并排序，
+整个程序中热的函数排在一起，而不只是在各自的文件内。
+*/
+struct symbol_score
+{
+	std::string name;
+	double score;
+};
+
+class symbol_order final
+{
+public:
+	static constexpr double COLD_SCORE = -1.0;
+	//按照从热到冷的顺序返回module中定义的函数及其分数，结果是确定的
+	static std::vector<symbol_score> compute(Module& mod);
+	//每行"分数 符号"，写入失败时返回false
+	static bool write(const std::vector<symbol_score>& symbols,
+		const std::string& file_name);
+};
+}   // end of namespace toy_compiler
+#endif
@@ -4,6 +4,10 @@
 #include "codegen.h"
 #include "llvm_ir_codegen.h"
 #include "llvm_optimizer.h"
+#include "opt_remarks.h"
+#include "symbol_order.h"
+#include "llvm/Support/CommandLine.h"	//for ParseCommandLineOptions
+#include "llvm/Transforms/Utils/Cloning.h"	//for CloneModule
 #include "flags.h"
 using namespace toy_compiler;
 using namespace std;
@@ -11,6 +15,125 @@ static void print_help()
 {
 	cout << "use stdin as input , stdout as output: ./compile " << endl;
 	cout << "use file_xx as input , file_xx.ll output: ./compile " << endl;
+	cout << "use file_xx file_yy ... as one unit, file_xx.o output: ./compile " << endl;
+}
+
+//ast_attribution模式下打印每个AST节点、函数和源码行对应的指令数
+static void report_attribution(LLVM_IR_code_generator& code_generator,
+	const char* stage)
+{
+	if (!global_flags.ast_attribution)
+		return;
+	const auto& origins = code_generator.get_ast_origins();
+	auto rpt = ir_attribution::collect(*code_generator.get_module(), origins);
+	ir_attribution::print(rpt, origins, stage, errs());
+}
+
+/*
+remarks模式下，优化期间的remarks写入remarks_file(为空时不写文件)，
+优化结束后把每个函数missed的优化打印到stderr。
+*/
+static bool setup_remarks(opt_remarks& remarks, const string& remarks_file)
+{
+	if (global_flags.debug_info == 0)
+		err_print(false, "remarks without debug_info have no source lines\n");
+	string format = global_flags.remarks_format;
+	string file_name;
+	if (!remarks_file.empty())
+		file_name = remarks_file + ".opt." + format;
+	return remarks.setup(file_name, global_flags.remarks_passes, format,
+		global_flags.pgo >= 2);
+}
+
+/*
+passes非空时按照自定义的pipeline优化，否则使用opt_level对应的默认优化。
+两种情况都只在opti打开时生效。
+*/
+static bool optimize(LLVM_IR_code_generator& code_generator,
+	const string& remarks_file = string())
+{
+	report_attribution(code_generator, "before optimize");
+	if (!global_flags.optimization)
+	{
+		if (global_flags.pgo)
+			err_print(false, "pgo needs opti=1, ignored\n");
+		if (global_flags.remarks)
+			err_print(false, "remarks needs opti=1, ignored\n");
+		return true;
+	}
+
+	Module* module = code_generator.get_module();
+	opt_remarks remarks(module->getContext());
+	if (global_flags.remarks && !setup_remarks(remarks, remarks_file))
+		return false;
+	string passes = global_flags.passes;
+	if (!passes.empty())
+	{
+		if (!llvm_optimizer::optimize_module(*module, passes))
+			return false;
+	}
+	else if (global_flags.size_opt)
+	{
+		//体积优先的配置固定使用Oz，其他选择优化方式的选项不生效
+		if (global_flags.adaptive_opt || global_flags.opt_jobs > 1
+			|| global_flags.opt_level != 2)
+			err_print(false, "opt_level, adaptive_opt and opt_jobs are ignored "
+				"with size_opt\n");
+		llvm_optimizer optimizer;
+		if (!optimizer.optimize_size(*module, global_flags.thin_lto))
+			return false;
+	}
+	else
+	{
+		int opt_level = global_flags.opt_level;
+		if (!llvm_optimizer::is_valid_opt_level(opt_level))
+		{
+			err_print(false, "invalid opt_level %d\n", opt_level);
+			return false;
+		}
+		if (global_flags.adaptive_opt)
+		{
+			//按函数调整的属性和热函数的额外优化都需要完整的module，在一个线程中优化
+			if (global_flags.opt_jobs > 1)
+				err_print(false, "opt_jobs is ignored with adaptive_opt\n");
+			llvm_optimizer optimizer;
+			int budget = global_flags.opt_budget;
+			optimizer.optimize_adaptive(*module, opt_level,
+				budget > 0 ? budget : 0, global_flags.thin_lto);
+		}
+		else if (global_flags.opt_jobs > 1)
+		{
+/*
+ThinLTO已经由链接时的backend并行，插桩的PGO和profile的匹配依赖完整的module，
+分区在各自的context中优化，remarks也收集不到，这些情况仍然在一个线程中优化
+*/
+			if (global_flags.thin_lto || global_flags.pgo || global_flags.remarks)
+			{
+				err_print(false,
+					"opt_jobs is ignored with thin_lto, pgo or remarks\n");
+				llvm_optimizer::optimize_module(*module, opt_level,
+					global_flags.thin_lto);
+			}
+			else if (!llvm_optimizer::optimize_module_parallel(*module, opt_level,
+				global_flags.opt_jobs))
+				return false;
+		}
+		else
+			llvm_optimizer::optimize_module(*module, opt_level,
+				global_flags.thin_lto);
+	}
+/*
+HotColdSplitting放在整个优化流水线之后，与LLVM默认流水线中的位置一致。
+ThinLTO的pre-link阶段不拆分，LLVM也把它推迟到链接时的backend，
+否则拆出的冷函数会影响跨module的导入和内联决策。
+*/
+	if (global_flags.hot_cold_split && !global_flags.thin_lto
+		&& !llvm_optimizer::optimize_module(*module, "hotcoldsplit"))
+		return false;
+	report_attribution(code_generator, "after optimize");
+	if (global_flags.remarks)
+		remarks.print_summary(errs());
+	return true;
 }
 
 static void stdin_stdout_compile()
@@ -28,18 +151,50 @@ extern声明，使得用户可以直接使用以库方式实现的operator。
 	const auto& ast_vec = t_parser.get_ast_vec();
 	LLVM_IR_code_generator code_generator;
 	code_generator.codegen(ast_vec);
-	Module* module = code_generator.get_module();
-	if (global_flags.optimization)
-		llvm_optimizer::optimize_module(*module);
+	if (!optimize(code_generator))
+		return;
 	code_generator.print_IR();
 }
 
 namespace toy_compiler{
 extern bool build_object(string& object_name, Module* module);
+extern bool build_thin_lto_bitcode(string& object_name, Module* module);
+extern bool get_object_text_size(const string& object_name, uint64_t& text_size);
+extern bool get_module_text_size(Module* module, uint64_t& text_size,
+	bool machine_outliner);
+}
+
+/*
+size_report模式下，用优化前的副本按默认的O2再编译一次，
+与实际输出的object对比代码段大小。
+*/
+static void report_text_size(Module* baseline, const string& object_name)
+{
+	uint64_t text_size, baseline_size;
+	if (!get_object_text_size(object_name, text_size))
+		return;
+	errs() << "text size of " << object_name << ": " << text_size << " bytes";
+	llvm_optimizer::optimize_module(*baseline, 2);
+	if (get_module_text_size(baseline, baseline_size, false) && baseline_size != 0)
+	{
+		int64_t reduction = (int64_t)baseline_size - (int64_t)text_size;
+		errs() << ", O2 build: " << baseline_size << " bytes, reduced "
+			<< reduction << " bytes (" << reduction * 100 / (int64_t)baseline_size
+			<< "%)";
+	}
+	errs() << "\n";
 }
 
-static bool file_compile(const char* infile)
+/*
+输入多个文件时是unity build：所有文件按顺序解析到同一个parser中，
+生成一个module，优化和生成object都只做一次，object以第一个文件命名。
+后面的文件可以直接使用前面文件定义的函数和operator，不需要extern。
+与单个文件一样，重复声明同一个函数或operator是错误。
+每个文件在调试信息中有自己的compile unit。
+*/
+static bool file_compile(char* infiles[], int file_num)
 {
+	const char* infile = infiles[0];
 	lexer t_lexer(infile);
 	if (!t_lexer.is_ok)
 	{
@@ -55,14 +210,45 @@ extern声明，使得用户可以直接使用以库方式实现的operator。
 	if (global_flags.builtin_core_operator)
 		t_parser.prepare_builtin_operator();
 	t_parser.parse();
+	for (int i = 1; i < file_num; ++i)
+	{
+		if (!t_lexer.open_file(infiles[i]))
+		{
+			err_print(false, "can not open input %s\n", infiles[i]);
+			return false;
+		}
+		t_parser.parse();
+	}
 	const auto& ast_vec = t_parser.get_ast_vec();
 	LLVM_IR_code_generator code_generator(infile);
 	code_generator.codegen(ast_vec);
 	Module* module = code_generator.get_module();
-	if (global_flags.optimization)
-		llvm_optimizer::optimize_module(*module);
+	std::unique_ptr<Module> baseline;
+	if (global_flags.size_report && !global_flags.thin_lto)
+		baseline = CloneModule(*module);
+	if (!optimize(code_generator, infile))
+		return false;
+	//ThinLTO的函数在链接时才生成代码，顺序由链接时的backend决定
+	if (global_flags.symbol_order && !global_flags.thin_lto)
+	{
+		string order_file = infile + string(".order");
+		if (!symbol_order::write(symbol_order::compute(*module), order_file))
+			return false;
+	}
 	string outfile = infile + string(".o");
-	toy_compiler::build_object(outfile, module);
+	//输出失败时返回false，compiler.sh不会链接缺失或者过期的.o
+	if (global_flags.thin_lto)
+	{
+		if (!toy_compiler::build_thin_lto_bitcode(outfile, module))
+			return false;
+	}
+	else
+	{
+		if (!toy_compiler::build_object(outfile, module))
+			return false;
+		if (baseline)
+			report_text_size(baseline.get(), outfile);
+	}
 	if (global_flags.save_temps)
 	{
 		string out_llvm_ir_file = outfile + ".ll";
@@ -71,21 +257,36 @@ extern声明，使得用户可以直接使用以库方式实现的operator。
 	return true;
 }
 
+/*
+x86没有默认outlining的函数，size_opt与llc -enable-machine-outliner=always一样
+对所有函数运行machine outliner。这是LLVM进程级的命令行选项，只在启动时设置一次，
+每个TargetMachine是否运行outliner仍由TargetOptions::EnableMachineOutliner决定。
+*/
+static void init_llvm_options()
+{
+	if (!global_flags.size_opt)
+		return;
+	const char* llvm_argv[] = {"toy_compiler", "-enable-machine-outliner=always"};
+	cl::ParseCommandLineOptions(2, llvm_argv);
+}
+
 int main(int argc, char* argv[])
 {
 	bool compile_ok = false;
+	init_llvm_options();
 	switch (argc)
 	{
 		case 1:
 			stdin_stdout_compile();
 			return 0;
-		case 2:
-			compile_ok = file_compile(argv[1]);
-			break;
 		default:
-			cout << "wrong input found, exiting\n" << endl;
-			print_help();
-			return 1;
+			if (argv[1] == string("-h") || argv[1] == string("--help"))
+			{
+				print_help();
+				return 0;
+			}
+			compile_ok = file_compile(argv + 1, argc - 1);
+			break;
 	}
 
 	return !compile_ok;
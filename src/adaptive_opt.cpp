@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <vector>
+#include "adaptive_opt.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/ProfileData/InstrProfReader.h"
+#include "llvm/ProfileData/SampleProfReader.h"
+#include "utils.h"
+
+namespace toy_compiler{
+using namespace std;
+
+/*
+instrumented profile中每个函数取所有计数器的和，sample profile取总采样数，
+两者都近似表示函数中执行的工作量。
+internal的函数在instrumented profile中带有"文件名:"前缀，额外按去掉前缀的名字记录。
+*/
+bool adaptive_opt_planner::load_profile(int pgo, const string& profile_file,
+	LLVMContext& ctx)
+{
+	profile_counts.clear();
+	has_profile = false;
+	if (pgo == 2)
+	{
+		auto reader_or_err = IndexedInstrProfReader::create(profile_file);
+		if (!reader_or_err)
+		{
+			err_print(false, "can not read profile %s: %s\n", profile_file.c_str(),
+				toString(reader_or_err.takeError()).c_str());
+			return false;
+		}
+		auto& reader = *reader_or_err;
+		for (const auto& record : *reader)
+		{
+			uint64_t count = 0;
+			for (auto block_count : record.Counts)
+				count += block_count;
+			StringRef name = record.Name;
+			profile_counts[name.str()] += count;
+			if (auto pos = name.rfind(':'); pos != StringRef::npos)
+				profile_counts[name.substr(pos + 1).str()] += count;
+		}
+		if (Error err = reader->getError())
+		{
+			err_print(false, "can not read profile %s: %s\n", profile_file.c_str(),
+				toString(std::move(err)).c_str());
+			return false;
+		}
+	}
+	else if (pgo == 3)
+	{
+		auto reader_or_err = SampleProfileReader::create(profile_file, ctx);
+		if (!reader_or_err || (*reader_or_err)->read())
+		{
+			err_print(false, "can not read sample profile %s\n",
+				profile_file.c_str());
+			return false;
+		}
+		for (const auto& entry : (*reader_or_err)->getProfiles())
+			profile_counts[entry.getKey().str()] = entry.getValue().getTotalSamples();
+	}
+	else
+		return true;
+	has_profile = true;
+	return true;
+}
+
+/*
+调用点的权重按照所在循环的深度增加，只统计本module中定义的callee。
+函数自身的循环也计入热度：循环中的每条指令按循环深度计，
+只被调用一次的kernel也能因为其中的热循环被识别为热函数。
+*/
+void adaptive_opt_planner::compute_static_hotness(Module& mod,
+	FunctionAnalysisManager& FAM, map<string, adaptive_decision>& decisions)
+{
+	for (auto& item : decisions)
+		item.second.is_root = true;
+	for (auto& func : mod)
+	{
+		if (func.isDeclaration())
+			continue;
+		auto& loop_info = FAM.getResult<LoopAnalysis>(func);
+		auto& decision = decisions[func.getName().str()];
+		for (auto& bb : func)
+		{
+			unsigned depth = loop_info.getLoopDepth(&bb);
+			decision.hotness += depth * bb.size();
+			uint64_t weight = 1 + LOOP_CALL_WEIGHT * depth;
+			for (auto& inst : bb)
+			{
+				auto call = dyn_cast<CallInst>(&inst);
+				if (call == nullptr)
+					continue;
+				Function* callee = call->getCalledFunction();
+				if (callee == nullptr || callee->isDeclaration())
+					continue;
+				auto& callee_decision = decisions[callee->getName().str()];
+				callee_decision.hotness += weight;
+				if (callee != &func)
+					callee_decision.is_root = false;
+			}
+		}
+	}
+}
+
+//热函数内联后，热循环在调用者中，调用者也要运行O3的循环流水线
+void adaptive_opt_planner::mark_hot_callers(Module& mod,
+	map<string, adaptive_decision>& decisions)
+{
+	for (auto& func : mod)
+	{
+		if (func.isDeclaration())
+			continue;
+		auto& decision = decisions[func.getName().str()];
+		if (decision.tier == TIER_HOT)
+			decision.hot_loops = true;
+		if (decision.tier != TIER_HOT && decision.tier != TIER_DEFAULT)
+			continue;
+		for (auto& inst : instructions(func))
+		{
+			auto call = dyn_cast<CallInst>(&inst);
+			if (call == nullptr)
+				continue;
+			Function* callee = call->getCalledFunction();
+			if (callee == nullptr || callee->isDeclaration())
+				continue;
+			if (decisions[callee->getName().str()].tier == TIER_HOT)
+			{
+				decision.hot_loops = true;
+				break;
+			}
+		}
+	}
+}
+
+map<string, adaptive_decision> adaptive_opt_planner::plan(Module& mod,
+	FunctionAnalysisManager& FAM, size_t budget)
+{
+	map<string, adaptive_decision> decisions;
+	for (auto& func : mod)
+	{
+		if (func.isDeclaration())
+			continue;
+		auto& decision = decisions[func.getName().str()];
+		decision.size = func.getInstructionCount();
+	}
+
+	uint64_t max_count = 0;
+	if (has_profile)
+	{
+		for (auto& item : decisions)
+		{
+			auto it = profile_counts.find(item.first);
+			item.second.hotness = it != profile_counts.cend() ? it->second : 0;
+			max_count = max(max_count, item.second.hotness);
+		}
+	}
+	else
+		compute_static_hotness(mod, FAM, decisions);
+
+/*
+有profile时，计数达到最大值十分之一的是热函数，不到千分之一的(含没有执行过的)是冷函数。
+没有profile时，没有循环且只在循环外被调用一次的是冷函数，
+例如只调用一次的大段初始化代码；入口函数不是冷函数。
+*/
+	auto is_hot = [&] (const adaptive_decision& decision)
+	{
+		if (has_profile)
+			return decision.hotness > 0 && decision.hotness * 10 >= max_count;
+		return decision.hotness >= STATIC_HOT_WEIGHT;
+	};
+	auto is_cold = [&] (const adaptive_decision& decision)
+	{
+		if (has_profile)
+			return decision.hotness * 1000 < max_count;
+		return !decision.is_root && decision.hotness <= 1;
+	};
+
+	vector<pair<const string, adaptive_decision>*> order;
+	for (auto& item : decisions)
+		order.push_back(&item);
+	//map本身按名字有序，stable_sort保证结果是确定的
+	stable_sort(order.begin(), order.end(),
+		[] (const pair<const string, adaptive_decision>* a,
+			const pair<const string, adaptive_decision>* b)
+		{
+			if (a->second.hotness != b->second.hotness)
+				return a->second.hotness > b->second.hotness;
+			return a->second.size < b->second.size;
+		});
+
+	size_t used = 0;
+	for (auto item : order)
+	{
+		auto& decision = item->second;
+		if (is_hot(decision) && decision.size <= SMALL_FUNC_SIZE)
+			decision.tier = TIER_HOT;
+		else if (is_cold(decision) && decision.size >= BIG_FUNC_SIZE)
+			decision.tier = TIER_SIZE;
+
+		size_t cost = decision.tier == TIER_HOT ? decision.size * 2 : decision.size;
+		if (budget != 0 && used + cost > budget)
+		{
+			//超出预算：巨型函数不做优化，其他函数按大小优化
+			decision.tier = decision.size >= HUGE_FUNC_SIZE ? TIER_NONE : TIER_SIZE;
+			continue;
+		}
+		//按大小优化的函数耗时较少，不占用预算
+		if (decision.tier != TIER_SIZE)
+			used += cost;
+	}
+	mark_hot_callers(mod, decisions);
+	return decisions;
+}
+
+void adaptive_opt_planner::apply(Module& mod,
+	const map<string, adaptive_decision>& decisions)
+{
+	for (const auto& item : decisions)
+	{
+		Function* func = mod.getFunction(item.first);
+		if (func == nullptr)
+			continue;
+		switch (item.second.tier)
+		{
+			case TIER_SIZE:
+				func->addFnAttr(Attribute::OptimizeForSize);
+				func->addFnAttr(Attribute::MinSize);
+				break;
+			case TIER_NONE:
+				//optnone要求同时有noinline
+				func->addFnAttr(Attribute::OptimizeNone);
+				func->addFnAttr(Attribute::NoInline);
+				break;
+			case TIER_HOT:	//module优化后单独处理，见hot_loops
+			case TIER_DEFAULT:
+			default:
+				break;
+		}
+	}
+}
+
+}	//end of toy_compiler
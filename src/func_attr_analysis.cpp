@@ -0,0 +1,261 @@
+#include <cassert>
+#include "func_attr_analysis.h"
+/*
+本文件在ast层面对def函数做过程间的属性推导。
+整体流程是：
+1 遍历每个def的函数体，得到摘要(调用了哪些函数，有没有for循环)
+2 用Tarjan算法找出调用图中的环，环上的函数可能递归，不能保证返回
+3 从最乐观的假设出发迭代，直到所有函数的属性不再变化。
+	每个函数的属性只能由其callee推导而下降，所以迭代一定会收敛。
+	环上的函数互相假设对方是readnone/nounwind，这与LLVM的
+	FunctionAttrs按SCC推导的做法一致。
+*/
+namespace toy_compiler{
+using namespace std;
+
+func_attr func_attr_analysis::get_declared_attr(const prototype_ast* proto)
+{
+	func_attr attr;
+	switch (proto->get_purity())
+	{
+		case PURITY_CONST:
+			attr.read_none = true;
+			//fallthrough
+		case PURITY_PURE:
+			attr.read_only = true;
+			attr.will_return = true;
+			//fallthrough
+		case PURITY_NOUNWIND:
+			attr.no_unwind = true;
+			break;
+		case PURITY_NONE:
+		default:
+			break;
+	}
+	return attr;
+}
+
+//遍历函数体，函数体可能很深，使用显式的栈而不是递归
+void func_attr_analysis::summarize(func_summary& summary)
+{
+	vector<const expr_ast*> work_list;
+	work_list.push_back(summary.func->get_body().get());
+	while (!work_list.empty())
+	{
+		const expr_ast* expr = work_list.back();
+		work_list.pop_back();
+		switch (expr->get_type())
+		{
+			case CALL_AST:
+			{
+				auto call = (const call_ast*)expr;
+				summary.callees.push_back(call->get_callee()->get_name());
+				for (const auto& arg : call->get_args())
+					work_list.push_back(arg.get());
+				break;
+			}
+			case BINARY_OPERATOR_AST:
+			{
+				auto bin = (const binary_operator_ast*)expr;
+				if (bin->get_op() == BINARY_USER_DEFINED)
+					summary.callees.push_back(bin->get_op_external_name());
+				work_list.push_back(bin->get_lhs().get());
+				work_list.push_back(bin->get_rhs().get());
+				break;
+			}
+			case UNARY_OPERATOR_AST:
+			{
+				auto unary = (const unary_operator_ast*)expr;
+				summary.callees.push_back(unary->get_op_external_name());
+				work_list.push_back(unary->get_operand().get());
+				break;
+			}
+			case IF_AST:
+			{
+				auto if_expr = (const if_ast*)expr;
+				work_list.push_back(if_expr->get_cond().get());
+				work_list.push_back(if_expr->get_then().get());
+				work_list.push_back(if_expr->get_else().get());
+				break;
+			}
+			case FOR_AST:
+			{
+				auto for_expr = (const for_ast*)expr;
+				//循环的结束条件是任意表达式，无法保证循环会结束
+				summary.has_loop = true;
+				work_list.push_back(for_expr->get_start().get());
+				work_list.push_back(for_expr->get_end().get());
+				if (for_expr->get_step())
+					work_list.push_back(for_expr->get_step().get());
+				work_list.push_back(for_expr->get_body().get());
+				break;
+			}
+			case VAR_AST:
+			{
+				auto var_expr = (const var_ast*)expr;
+				for (const auto& value : var_expr->get_var_values())
+					work_list.push_back(value.get());
+				work_list.push_back(var_expr->get_body().get());
+				break;
+			}
+			//常量和变量读取都不影响函数属性
+			default:
+				break;
+		}
+	}
+}
+
+void func_attr_analysis::strong_connect(func_summary& summary, int& index,
+	vector<func_summary*>& scc_stack)
+{
+	summary.dfs_index = index;
+	summary.low_link = index;
+	++index;
+	scc_stack.push_back(&summary);
+	summary.on_stack = true;
+
+	for (const auto& callee_name : summary.callees)
+	{
+		auto it = defined_funcs.find(callee_name);
+		if (it == defined_funcs.end())
+			continue;
+		auto& callee = it->second;
+		if (&callee == &summary)	//直接递归
+			summary.in_cycle = true;
+		if (callee.dfs_index < 0)
+		{
+			strong_connect(callee, index, scc_stack);
+			summary.low_link = min(summary.low_link, callee.low_link);
+		}
+		else if (callee.on_stack)
+			summary.low_link = min(summary.low_link, callee.dfs_index);
+	}
+
+	if (summary.low_link != summary.dfs_index)
+		return;
+	//summary是SCC的根，弹出整个SCC，多于一个函数的SCC都是环
+	vector<func_summary*> scc;
+	func_summary* member;
+	do
+	{
+		member = scc_stack.back();
+		scc_stack.pop_back();
+		member->on_stack = false;
+		scc.push_back(member);
+	} while (member != &summary);
+	if (scc.size() > 1)
+	{
+		for (auto scc_member : scc)
+			scc_member->in_cycle = true;
+	}
+}
+
+void func_attr_analysis::mark_cycles()
+{
+	int index = 0;
+	vector<func_summary*> scc_stack;
+	for (auto& func : defined_funcs)
+	{
+		if (func.second.dfs_index < 0)
+			strong_connect(func.second, index, scc_stack);
+	}
+	assert(scc_stack.empty());
+}
+
+func_attr func_attr_analysis::get_callee_attr(const string& name) const
+{
+	if (auto it = result.find(name); it != result.cend())
+		return it->second;
+
+	func_attr attr;
+	if (auto it = extern_protos.find(name); it != extern_protos.cend())
+	{
+		if (is_intrinsic && is_intrinsic(it->second))
+		{
+			attr.read_none = attr.read_only = true;
+			attr.no_unwind = attr.no_recurse = attr.will_return = true;
+		}
+		else
+			attr = get_declared_attr(it->second);
+	}
+	//找不到声明的函数按照最坏的情况处理
+	return attr;
+}
+
+void func_attr_analysis::run(const ast_vector_t& global_vec,
+	function<bool(const prototype_ast*)> intrinsic_checker)
+{
+	defined_funcs.clear();
+	extern_protos.clear();
+	result.clear();
+	is_intrinsic = std::move(intrinsic_checker);
+
+	for (const auto& ast : global_vec)
+	{
+		if (ast->get_type() == FUNCTION_AST)
+		{
+			auto func = (const function_ast*)ast.get();
+			auto& summary = defined_funcs[func->get_prototype()->get_name()];
+			summary.func = func;
+		}
+		else if (ast->get_type() == PROTOTYPE_AST)
+		{
+			auto proto = (const prototype_ast*)ast.get();
+			extern_protos[proto->get_name()] = proto;
+		}
+	}
+
+	for (auto& func : defined_funcs)
+		summarize(func.second);
+	mark_cycles();
+
+	//从最乐观的假设开始
+	for (const auto& func : defined_funcs)
+	{
+		const auto& summary = func.second;
+		auto& attr = result[func.first];
+		attr.read_none = attr.read_only = attr.no_unwind = true;
+		attr.no_recurse = !summary.in_cycle;
+		attr.will_return = !summary.in_cycle && !summary.has_loop;
+	}
+
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (const auto& func : defined_funcs)
+		{
+			const auto& summary = func.second;
+			func_attr attr = result[func.first];
+			for (const auto& callee_name : summary.callees)
+			{
+				func_attr callee_attr = get_callee_attr(callee_name);
+				attr.read_none = attr.read_none && callee_attr.read_none;
+				attr.read_only = attr.read_only && callee_attr.read_only;
+				attr.no_unwind = attr.no_unwind && callee_attr.no_unwind;
+				attr.no_recurse = attr.no_recurse && callee_attr.no_recurse;
+				attr.will_return = attr.will_return && callee_attr.will_return;
+			}
+			//def上显式声明的pure/const由用户保证，推导结果不低于声明
+			func_attr declared = get_declared_attr(
+				summary.func->get_prototype().get());
+			attr.read_none = attr.read_none || declared.read_none;
+			attr.read_only = attr.read_only || declared.read_only;
+			attr.no_unwind = attr.no_unwind || declared.no_unwind;
+			attr.will_return = attr.will_return || declared.will_return;
+
+			auto& old_attr = result[func.first];
+			if (attr.read_none != old_attr.read_none
+				|| attr.read_only != old_attr.read_only
+				|| attr.no_unwind != old_attr.no_unwind
+				|| attr.no_recurse != old_attr.no_recurse
+				|| attr.will_return != old_attr.will_return)
+			{
+				old_attr = attr;
+				changed = true;
+			}
+		}
+	}
+}
+
+}	//end of toy_compiler
@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <vector>
+#include "ir_attribution.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfoMetadata.h"	//for DILocation::getFilename
+#include "llvm/IR/DebugLoc.h"
+#include "llvm/IR/Metadata.h"
+
+namespace toy_compiler{
+using namespace std;
+
+static const char* const attribution_md_name = "toy.ast";
+
+void ir_attribution::tag(Instruction* inst, uint64_t ast_id)
+{
+	auto& ctx = inst->getContext();
+	auto id_md = ConstantAsMetadata::get(
+		ConstantInt::get(Type::getInt64Ty(ctx), ast_id));
+	inst->setMetadata(attribution_md_name, MDNode::get(ctx, id_md));
+}
+
+bool ir_attribution::get_tag(const Instruction* inst, uint64_t& ast_id)
+{
+	MDNode* node = inst->getMetadata(attribution_md_name);
+	if (node == nullptr || node->getNumOperands() != 1)
+		return false;
+	auto id_md = dyn_cast<ConstantAsMetadata>(node->getOperand(0));
+	if (id_md == nullptr)
+		return false;
+	auto id_val = dyn_cast<ConstantInt>(id_md->getValue());
+	if (id_val == nullptr)
+		return false;
+	ast_id = id_val->getZExtValue();
+	return true;
+}
+
+ir_attribution::report ir_attribution::collect(const Module& mod,
+	const unordered_map<uint64_t, ast_origin>& origins)
+{
+	report rpt;
+	for (const auto& func : mod)
+	{
+		for (const auto& bb : func)
+		{
+			for (const auto& inst : bb)
+			{
+				++rpt.total;
+				++rpt.per_function[func.getName().str()];
+				uint64_t ast_id;
+				bool tagged = get_tag(&inst, ast_id);
+				if (tagged)
+					++rpt.per_ast[ast_id];
+				else
+					++rpt.unattributed;
+
+				pair<string, int64_t> line(string(), 0);
+				if (const DebugLoc& loc = inst.getDebugLoc())
+					line = {loc->getFilename().str(), loc.getLine()};
+				else if (tagged)
+				{
+					if (auto it = origins.find(ast_id); it != origins.cend())
+						line = {it->second.file, it->second.line};
+				}
+				++rpt.per_line[line];
+			}
+		}
+	}
+	return rpt;
+}
+
+static const char* get_ast_type_name(ast_t type)
+{
+	//与ast_type的定义顺序保持一致
+	static const char* const names[UNKNOWN_AST + 1] =
+	{
+		"generic", "expr", "prototype", "function", "number", "variable",
+		"binary", "unary", "call", "if", "for", "var", "unknown"
+	};
+	return type <= UNKNOWN_AST ? names[type] : "unknown";
+}
+
+//按照指令数从多到少排序，数目相同的保持key的顺序
+template <typename KEY>
+static vector<pair<KEY, size_t>> get_top_items(const map<KEY, size_t>& counts,
+	size_t top_n)
+{
+	vector<pair<KEY, size_t>> items(counts.cbegin(), counts.cend());
+	stable_sort(items.begin(), items.end(),
+		[] (const pair<KEY, size_t>& a, const pair<KEY, size_t>& b)
+		{
+			return a.second > b.second;
+		});
+	if (items.size() > top_n)
+		items.resize(top_n);
+	return items;
+}
+
+void ir_attribution::print(const report& rpt,
+	const unordered_map<uint64_t, ast_origin>& origins,
+	const string& title, raw_ostream& out, size_t top_n)
+{
+	out << "ast attribution (" << title << "): " << rpt.total
+		<< " instructions, " << rpt.unattributed << " unattributed\n";
+
+	out << "  per function:\n";
+	for (const auto& item : get_top_items(rpt.per_function, top_n))
+		out << "    " << item.first << "\t" << item.second << "\n";
+
+	out << "  per source line:\n";
+	for (const auto& item : get_top_items(rpt.per_line, top_n))
+	{
+		if (item.first.second == 0)
+			out << "    <unknown>\t" << item.second << "\n";
+		else
+			out << "    " << item.first.first << ":" << item.first.second
+				<< "\t" << item.second << "\n";
+	}
+
+	out << "  per ast node:\n";
+	for (const auto& item : get_top_items(rpt.per_ast, top_n))
+	{
+		out << "    ast " << item.first;
+		if (auto it = origins.find(item.first); it != origins.cend())
+			out << " " << get_ast_type_name(it->second.type) << " at "
+				<< it->second.line << ":" << it->second.col;
+		out << "\t" << item.second << "\n";
+	}
+}
+
+}	//end of toy_compiler
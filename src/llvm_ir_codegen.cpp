@@ -8,6 +8,20 @@
 namespace toy_compiler{
 using namespace std;
 
+//在作用域内把发射的指令归属到ast，离开作用域时恢复原来的归属
+class ast_scope_guard
+{
+	const generic_ast*& cur_ast;
+	const generic_ast* saved_ast;
+public:
+	ast_scope_guard(const generic_ast*& cur, const generic_ast* ast)
+		: cur_ast(cur), saved_ast(cur)
+	{
+		cur_ast = ast;
+	}
+	~ast_scope_guard() {cur_ast = saved_ast;}
+};
+
 /*
 这里的很多骨架逻辑是可以抽象到父类中去的。
 如检查重复定义，先gen_prototype然后处理body。
@@ -17,6 +31,8 @@ using namespace std;
 */
 bool LLVM_IR_code_generator::gen_function(const function_ast* func)
 {
+	//入参的store和ret等不属于任何expr的指令，归属到函数本身
+	ast_scope_guard ast_guard(cur_ast, func);
 	//1 重复定义检查
 	auto proto = func->get_prototype();
 	auto proto_ptr = proto.get();
@@ -48,6 +64,24 @@ transfer of control bypasses initialization of:
 	//gen_prototype会创建llvm中的函数声明
 	cur_func = the_module->getFunction(func_name);
 	assert(cur_func != nullptr);
+	//设置本函数的fast math，后续发射的浮点指令都会带上对应的flags
+	set_fast_math(proto_ptr);
+	//新版本的SampleProfileLoader只处理带有该属性的函数，与clang的做法一致
+	if (global_flags.pgo == 3)
+		cur_func->addFnAttr("use-sample-profile");
+
+/*
+whole_program模式下，除main和export的函数外，其他函数对外不可见。
+internal的函数LLVM可以任意修改其调用约定和参数(如删除无用参数、
+常量传播)，完全内联后也可以删除函数体。使用fastcc配合目标上的
+GuaranteedTailCallOpt，尾调用也能得到保证。
+调用处都从callee上取调用约定，而函数总是先定义再被调用，所以这里设置即可。
+*/
+	if (internalize && func_name != "main" && !proto_ptr->get_exported())
+	{
+		cur_func->setLinkage(Function::InternalLinkage);
+		cur_func->setCallingConv(CallingConv::Fast);
+	}
 
 /*
 做其他动作前，创建函数的entry block，设置好插入点。
@@ -67,36 +101,21 @@ push scope的动作必须在args的生成动作之前，因为现在入参也有
 */
 	if (debug_info)
 	{
+		//unity build时按函数所在的源文件切换compile unit
+		debug_info->select_unit(proto_ptr->get_loc().file_name);
 		auto dbg_builder = debug_info->DBuilder;
-		auto cu = debug_info->compile_unit;
-/*
-fixme!!Unit 似乎不应该重复分配？如果同一个compile_unit中
-出现多个文件，如C中的#include，这里应该从ast中取filename和dir。
-*/
-		DIFile* unit = dbg_builder->createFile(
-			cu->getFilename(), cu->getDirectory());
+		DIFile* unit = debug_info->file;
 		DIScope* fun_context = unit;
-		DIType* double_type = debug_info->double_type;
 		unsigned line_no = proto_ptr->get_line();
 		unsigned scope_line = line_no;
-		auto CreateFunctionType = 
-			[double_type, dbg_builder] (unsigned num_args) 
-		{
-			SmallVector<Metadata *, 8> EltTys;
-			// Add the result type.
-			EltTys.push_back(double_type);
-
-			for (unsigned i = 0, e = num_args; i != e; ++i)
-				EltTys.push_back(double_type);
-
-			return dbg_builder->createSubroutineType(
-				dbg_builder->getOrCreateTypeArray(EltTys));
-		};
 
+		auto sp_flags = DISubprogram::SPFlagDefinition;
+		if (cur_func->hasLocalLinkage())
+			sp_flags |= DISubprogram::SPFlagLocalToUnit;
 		DISubprogram *sub_prog = dbg_builder->createFunction(
 			fun_context, proto_ptr->get_name(), StringRef(), unit, line_no,
-			CreateFunctionType(cur_func->arg_size()), scope_line,
-			DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+			debug_info->get_subroutine_type(cur_func->arg_size()), scope_line,
+			DINode::FlagPrototyped, sp_flags);
 		cur_func->setSubprogram(sub_prog);
 		// Push the current scope.
 		debug_info->lexical_blocks.push_back(sub_prog);
@@ -114,16 +133,19 @@ fixme!!Unit 似乎不应该重复分配？如果同一个compile_unit中
 
 	//创建args查找map，方便后续variable引用
 	named_var.clear();
+	arg_allocas.clear();
+	scoped_allocas.clear();
 	for (auto &arg : cur_func->args())
 	{
 		const string& arg_name = arg.getName().str();
 		auto arg_alloca = create_alloca_at_func_entry(cur_func, arg_name);
 		ir_builder.CreateStore(&arg, arg_alloca);
 		named_var[arg_name] = arg_alloca;
+		arg_allocas.push_back(arg_alloca);
 	}
 
-	//为所有的入参准备调试信息
-	if (debug_info)
+	//为所有的入参准备调试信息，line tables级别不需要变量信息
+	if (debug_info && debug_info->is_full())
 	{
 		auto dbg_builder = debug_info->DBuilder;
 		auto sub_prog = cur_func->getSubprogram();
@@ -149,6 +171,25 @@ fixme!!Unit 似乎不应该重复分配？如果同一个compile_unit中
 
 	//原示例在这里emitLocation(body)是冗余的，每一个ast自己会去emit
 
+/*
+找出body中处于尾调用位置的call。如果有自递归的尾调用，
+入参初始化完成后进入tailrecurse，自递归尾调用写入新入参后跳回这里。
+这样即使不开优化，递归累加器式的写法也不会消耗栈空间。
+*/
+	collect_tail_calls(func->get_body().get());
+	tail_recurse_bb = nullptr;
+	for (auto call : tail_calls)
+	{
+		if (((const call_ast*)call)->get_callee()->get_name() == func_name)
+		{
+			tail_recurse_bb = BasicBlock::Create(the_context, "tailrecurse",
+				cur_func);
+			ir_builder.CreateBr(tail_recurse_bb);
+			ir_builder.SetInsertPoint(tail_recurse_bb);
+			break;
+		}
+	}
+
 	//3 生成body
 	//build_expr中会调用ir_builder插入计算expr结果的运算指令
 	ret_val = build_expr(func->get_body().get());
@@ -190,6 +231,7 @@ Expected no forward declarations!
 
 	//只要离开本函数，都应该把cur_func重新设置为空
 	cur_func = nullptr;
+	ir_builder.clearFastMathFlags();
 	//弹出调试信息的scope
 	if (debug_info)
 		debug_info->lexical_blocks.pop_back();
@@ -203,9 +245,70 @@ err_exit:
   //remove  function which is incompleted
 	cur_func->eraseFromParent();
 	cur_func = nullptr;
+	ir_builder.clearFastMathFlags();
 	return false;
 }
 
+/*
+fast_math级别与LLVM fast math flags的对应关系：
+1 contract，允许将a*b+c合并为fma
+2 在1的基础上允许reassoc，for循环中的浮点累加才能重排和向量化
+3 全部的fast math flags
+IRBuilder上的flags会附加到之后发射的每一条浮点指令上，函数属性则供后端
+和内联时使用。strict的函数被内联到fast的函数中时，其指令保留自己的
+(空)flags，内联也会合并函数属性，所以不会被放宽。
+*/
+void LLVM_IR_code_generator::set_fast_math(const prototype_ast* proto)
+{
+	int level = proto->get_fast_math_level();
+	if (level < 0)
+		level = global_flags.fast_math;
+
+	FastMathFlags FMF;
+	if (level >= 1)
+	{
+		FMF.setAllowContract();
+		cur_func->addFnAttr("less-precise-fpmad", "true");
+	}
+	if (level >= 2)
+		FMF.setAllowReassoc();
+	if (level >= 3)
+	{
+		FMF.setFast();
+		cur_func->addFnAttr("unsafe-fp-math", "true");
+		cur_func->addFnAttr("no-infs-fp-math", "true");
+		cur_func->addFnAttr("no-nans-fp-math", "true");
+		cur_func->addFnAttr("no-signed-zeros-fp-math", "true");
+	}
+	ir_builder.setFastMathFlags(FMF);
+}
+
+/*
+生成前先在ast层面推导所有def函数的属性，gen_prototype时直接发射。
+会被替换为intrinsic的extern数学函数，对推导来说等同于const函数。
+同时确定是否需要按whole_program模式内部化函数：只有定义了main的
+可执行程序才能确定所有的调用者都在本module中。
+*/
+bool LLVM_IR_code_generator::codegen(const ast_vector_t& global_vec)
+{
+	internalize = false;
+	if (global_flags.whole_program)
+	{
+		for (const auto& ast : global_vec)
+		{
+			if (ast->get_type() == FUNCTION_AST && ((const function_ast*)
+				ast.get())->get_prototype()->get_name() == "main")
+				internalize = true;
+		}
+	}
+	attr_analysis.run(global_vec, [] (const prototype_ast* proto)
+		{
+			return find_math_intrinsic(proto->get_name(),
+				proto->get_args().size()) != Intrinsic::not_intrinsic;
+		});
+	return code_generator<Value *>::codegen(global_vec);
+}
+
 //gen_prototype的主要任务是构建llvm的函数声明 
 bool LLVM_IR_code_generator::gen_prototype(const prototype_ast* proto)
 {
@@ -223,37 +326,147 @@ bool LLVM_IR_code_generator::gen_prototype(const prototype_ast* proto)
 	for (auto& arg : F->args())
 		arg.setName(arg_str_vec[idx++]);
 
+/*
+声明了副作用级别或者推导出属性的函数，LLVM才能对其调用做LICM、CSE等优化。
+否则只能假设任何extern调用都可能写内存、抛出异常。
+def函数的属性由codegen前的func_attr_analysis推导(已包含显式声明)，
+extern以及单独gen_function的情况只使用显式声明。
+*/
+	const func_attr* inferred_attr = attr_analysis.find(proto->get_name());
+	func_attr attr = inferred_attr != nullptr ? *inferred_attr
+		: func_attr_analysis::get_declared_attr(proto);
+	if (attr.read_none)
+		F->addFnAttr(Attribute::ReadNone);
+	else if (attr.read_only)
+		F->addFnAttr(Attribute::ReadOnly);
+	if (attr.no_unwind)
+		F->addFnAttr(Attribute::NoUnwind);
+	if (attr.no_recurse)
+		F->addFnAttr(Attribute::NoRecurse);
+	if (attr.will_return)
+		F->addFnAttr(Attribute::WillReturn);
+
 //fixme!! 这里的所有操作都一定能成功么？？
 	return true;
 }
 
-Value* LLVM_IR_code_generator::build_expr(const expr_ast* expr)
+/*
+表达式树可能非常深，例如很长的','序列会形成深度与语句数相同的binary树，
+递归地生成会耗尽native栈。这里用显式的栈做后序遍历：
+work_stack记录还未完成的节点，以及下一个要求值的操作数；
+value_stack记录已经求出的操作数，节点完成时从栈顶取走自己的操作数。
+binary、unary和call在这里展开，if/for/var仍然交给各自的build函数，
+这样native栈的深度只与控制流的嵌套层数有关。
+*/
+Value* LLVM_IR_code_generator::build_expr(const expr_ast* root)
+{
+	struct pending_expr
+	{
+		const expr_ast* expr;
+		unsigned next_operand;
+	};
+	SmallVector<pending_expr, 32> work_stack;
+	SmallVector<Value *, 32> value_stack;
+	ast_scope_guard ast_guard(cur_ast, cur_ast);
+	work_stack.push_back({root, 0});
+	while (!work_stack.empty())
+	{
+		auto& top = work_stack.back();
+		const expr_ast* expr = top.expr;
+		if (auto operand = get_operand(expr, top.next_operand))
+		{
+			++top.next_operand;
+			//push_back之后top可能失效，不能再使用
+			work_stack.push_back({operand, 0});
+			continue;
+		}
+
+		//所有操作数都已经求值，它们位于value_stack的栈顶
+		unsigned operand_num = top.next_operand;
+		work_stack.pop_back();
+		assert(value_stack.size() >= operand_num);
+		ArrayRef<Value *> operands(value_stack.end() - operand_num,
+			operand_num);
+		Value* val = nullptr;
+		cur_ast = expr;
+		switch (expr->get_type())
+		{
+			case CALL_AST:
+				val = emit_call((const call_ast*) expr, operands);
+				break;
+			case NUMBER_AST:
+				val = build_number((const number_ast*) expr);
+				break;
+			case VARIABLE_AST:
+				val = build_variable((const variable_ast*) expr);
+				break;
+			case BINARY_OPERATOR_AST:
+				val = emit_binary_op((const binary_operator_ast *)expr, operands);
+				break;
+			case UNARY_OPERATOR_AST:
+				val = emit_unary_op((const unary_operator_ast *)expr, operands);
+				break;
+			case IF_AST:
+				val = build_if((const if_ast *)expr);
+				break;
+			case FOR_AST:
+				val = build_for((const for_ast *)expr);
+				break;
+			case VAR_AST:
+				val = build_var((const var_ast *)expr);
+				break;
+			default:
+				err_print(/*isfatal*/true, "found unknown expr AST, aborting\n");
+		}
+		//出错的原因已经由各个build/emit函数打印，这里只需要逐层返回
+		if (val == nullptr)
+			return nullptr;
+		value_stack.resize(value_stack.size() - operand_num);
+		value_stack.push_back(val);
+	}
+	assert(value_stack.size() == 1);
+	return value_stack.back();
+}
+
+/*
+返回expr的第idx个需要先求值的操作数，没有更多的操作数时返回nullptr。
+操作数的顺序就是求值顺序，与原来递归生成时保持一致。
+赋值的lhs是变量的地址而不是值，不需要求值。
+*/
+const expr_ast* LLVM_IR_code_generator::get_operand(const expr_ast* expr,
+	unsigned idx)
 {
 	switch (expr->get_type())
 	{
 		case CALL_AST:
-			return build_call((const call_ast*) expr);
-		case NUMBER_AST:
-			return build_number((const number_ast*) expr);
-		case VARIABLE_AST:
-			return build_variable((const variable_ast*) expr);
+		{
+			const auto& args = ((const call_ast*)expr)->get_args();
+			return idx < args.size() ? args[idx].get() : nullptr;
+		}
 		case BINARY_OPERATOR_AST:
-			return build_binary_op((const binary_operator_ast *)expr);
+		{
+			auto bin = (const binary_operator_ast*)expr;
+			if (bin->get_op() == BINARY_ASSIGN)
+				return idx == 0 ? bin->get_rhs().get() : nullptr;
+			if (idx == 0)
+				return bin->get_lhs().get();
+			return idx == 1 ? bin->get_rhs().get() : nullptr;
+		}
 		case UNARY_OPERATOR_AST:
-			return build_unary_op((const unary_operator_ast *)expr);
-		case IF_AST:
-			return build_if((const if_ast *)expr);
-		case FOR_AST:
-			return build_for((const for_ast *)expr);
-		case VAR_AST:
-			return build_var((const var_ast *)expr);
+			return idx == 0 ?
+				((const unary_operator_ast*)expr)->get_operand().get() : nullptr;
 		default:
-			err_print(/*isfatal*/true, "found unknown expr AST, aborting\n");
+			return nullptr;
 	}
-	return nullptr;
 }
 
 Value* LLVM_IR_code_generator::build_call(const call_ast* callee)
+{
+	return build_expr(callee);
+}
+
+Value* LLVM_IR_code_generator::emit_call(const call_ast* callee,
+	ArrayRef<Value *> args_vec)
 {
 	// Look up the name in the global module table.
 	const string& callee_name = callee->get_callee()->get_name();
@@ -263,22 +476,167 @@ Value* LLVM_IR_code_generator::build_call(const call_ast* callee)
 
 	//检查传入点和定义点的参数个数是否一致，类型都是double无需检查
 	auto def_arg_size = callee_func->arg_size();
-	auto passed_arg_vec = callee->get_args();
-	auto passed_arg_size = passed_arg_vec.size();
+	auto passed_arg_size = args_vec.size();
 	print_and_return_nullptr_if_check_fail(def_arg_size == passed_arg_size,
 		"expected %lu args but passed %lu\n", def_arg_size, passed_arg_size);
-	//为llvm的调用指令准备参数vector
-	std::vector<Value *> args_vec;
-	for (unsigned int idx = 0; idx < passed_arg_size; idx++)
+	emit_location(callee->get_loc());
+	//常见的extern数学函数改为调用llvm的intrinsic
+	auto intrinsic_id = find_math_intrinsic(callee_func);
+	if (intrinsic_id != Intrinsic::not_intrinsic)
 	{
-		auto arg_val = build_expr(passed_arg_vec[idx].get());
-		print_and_return_nullptr_if_check_fail(arg_val != nullptr, 
-			"can not get value when passing arg %d  for calling %s\n",
-			idx, callee_name.c_str());
-		args_vec.push_back(arg_val);
+		Function* intrinsic_func = Intrinsic::getDeclaration(the_module,
+			intrinsic_id, {Type::getDoubleTy(the_context)});
+		return ir_builder.CreateCall(intrinsic_func, args_vec,
+			"call" + callee_name);
 	}
-	emit_location(callee->get_loc());
-	return ir_builder.CreateCall(callee_func, args_vec, "call" + callee_name);
+	if (tail_calls.count(callee) != 0)
+		return build_tail_call(callee, callee_func, args_vec);
+	CallInst* call = ir_builder.CreateCall(callee_func, args_vec,
+		"call" + callee_name);
+	call->setCallingConv(callee_func->getCallingConv());
+	return call;
+}
+
+/*
+尾调用位置：函数body，尾调用位置上的if的then/else分支、var的body、','的rhs。
+其余位置(如call的参数、for的body)求值后还要继续使用，不是尾调用。
+*/
+void LLVM_IR_code_generator::collect_tail_calls(const expr_ast* body)
+{
+	tail_calls.clear();
+	vector<const expr_ast*> work_list{body};
+	while (!work_list.empty())
+	{
+		const expr_ast* expr = work_list.back();
+		work_list.pop_back();
+		switch (expr->get_type())
+		{
+			case CALL_AST:
+				tail_calls.insert(expr);
+				break;
+			case IF_AST:
+				//会被lower为select的if，其分支中不会有call
+				work_list.push_back(((const if_ast*)expr)->get_then().get());
+				work_list.push_back(((const if_ast*)expr)->get_else().get());
+				break;
+			case VAR_AST:
+				work_list.push_back(((const var_ast*)expr)->get_body().get());
+				break;
+			case BINARY_OPERATOR_AST:
+			{
+				auto bin = (const binary_operator_ast*)expr;
+				if (bin->get_op() == BINARY_USER_DEFINED
+					&& find_core_op(bin->get_op_external_name())
+						== CORE_OP_SEQUENCE)
+					work_list.push_back(bin->get_rhs().get());
+				break;
+			}
+			default:
+				break;
+		}
+	}
+}
+
+/*
+尾调用的值就是函数的返回值，所以在调用后直接ret，不再经过if的PHI等。
+这样O0下后端也能看到call后紧跟ret的尾调用形态。
+1 自递归：写入新的入参后跳回tailrecurse，完全消除递归
+2 签名和调用约定与当前函数一致：musttail，任何优化级别都保证尾调用
+3 其他：标记tail，由后端尽量做尾调用
+ret之后的代码是不可达的，为其新建一个没有前驱的bb继续发射，
+返回undef给上层(如if的PHI)使用，优化时这些不可达的bb会被删掉。
+*/
+Value* LLVM_IR_code_generator::build_tail_call(const call_ast* callee,
+	Function* callee_func, ArrayRef<Value *> args_vec)
+{
+	const string& callee_name = callee->get_callee()->get_name();
+	if (callee_func == cur_func && tail_recurse_bb != nullptr)
+	{
+		//入参已经全部求值，再统一写入，避免新入参的计算读到更新后的值
+		assert(args_vec.size() == arg_allocas.size());
+		for (size_t i = 0; i < args_vec.size(); ++i)
+			ir_builder.CreateStore(args_vec[i], arg_allocas[i]);
+		//跳回函数开头，外层var/for的作用域都结束了
+		for (auto alloca : scoped_allocas)
+			emit_lifetime_end(alloca);
+		ir_builder.CreateBr(tail_recurse_bb);
+	}
+	else
+	{
+		//入参都已经load出来了，call之前就可以结束局部变量的lifetime
+		for (auto alloca : scoped_allocas)
+			emit_lifetime_end(alloca);
+		CallInst* call = ir_builder.CreateCall(callee_func, args_vec,
+			"call" + callee_name);
+		call->setCallingConv(callee_func->getCallingConv());
+		if (callee_func->getFunctionType() == cur_func->getFunctionType()
+			&& callee_func->getCallingConv() == cur_func->getCallingConv())
+			call->setTailCallKind(CallInst::TCK_MustTail);
+		else
+			call->setTailCallKind(CallInst::TCK_Tail);
+		ir_builder.CreateRet(call);
+	}
+
+	BasicBlock* dead_bb = BasicBlock::Create(the_context, "after_tail_call",
+		cur_func);
+	ir_builder.SetInsertPoint(dead_bb);
+	return UndefValue::get(Type::getDoubleTy(the_context));
+}
+
+/*
+extern声明的常见数学函数，对LLVM来说只是不透明的外部函数，
+调用它们的循环无法向量化，常量参数也无法在编译期折叠。
+这里把它们映射到对应的llvm.*.f64 intrinsic，intrinsic自带readnone等属性，
+后端最终仍会lower为libm的调用(或者向量数学库的调用)。
+只有extern声明(module中没有函数体)且参数个数匹配的才做映射，
+用户自己def的同名函数保持原样。
+*/
+Intrinsic::ID LLVM_IR_code_generator::find_math_intrinsic(Function* func)
+{
+	if (!func->isDeclaration())
+		return Intrinsic::not_intrinsic;
+	return find_math_intrinsic(func->getName(), func->arg_size());
+}
+
+Intrinsic::ID LLVM_IR_code_generator::find_math_intrinsic(StringRef name,
+	size_t arg_num)
+{
+	struct math_intrinsic_item
+	{
+		const char* name;
+		size_t arg_num;
+		Intrinsic::ID id;
+	};
+	static const math_intrinsic_item math_intrinsic_tab[] =
+	{
+		{"sin", 1, Intrinsic::sin},
+		{"cos", 1, Intrinsic::cos},
+		{"sqrt", 1, Intrinsic::sqrt},
+		{"exp", 1, Intrinsic::exp},
+		{"exp2", 1, Intrinsic::exp2},
+		{"log", 1, Intrinsic::log},
+		{"log2", 1, Intrinsic::log2},
+		{"log10", 1, Intrinsic::log10},
+		{"fabs", 1, Intrinsic::fabs},
+		{"floor", 1, Intrinsic::floor},
+		{"ceil", 1, Intrinsic::ceil},
+		{"trunc", 1, Intrinsic::trunc},
+		{"round", 1, Intrinsic::round},
+		{"rint", 1, Intrinsic::rint},
+		{"nearbyint", 1, Intrinsic::nearbyint},
+		{"pow", 2, Intrinsic::pow},
+		{"copysign", 2, Intrinsic::copysign},
+		{"fmin", 2, Intrinsic::minnum},
+		{"fmax", 2, Intrinsic::maxnum},
+		{"fma", 3, Intrinsic::fma},
+	};
+
+	for (const auto& item : math_intrinsic_tab)
+	{
+		if (name == item.name && arg_num == item.arg_num)
+			return item.id;
+	}
+	return Intrinsic::not_intrinsic;
 }
 
 Value* LLVM_IR_code_generator::build_number(const number_ast* num)
@@ -306,6 +664,13 @@ Value* LLVM_IR_code_generator::build_variable(const variable_ast* var)
 }
 
 Value* LLVM_IR_code_generator::build_binary_op(const binary_operator_ast* bin)
+{
+	return build_expr(bin);
+}
+
+//operands是build_expr按照get_operand的顺序求出的值
+Value* LLVM_IR_code_generator::emit_binary_op(const binary_operator_ast* bin,
+	ArrayRef<Value *> operands)
 {
 	if (bin->get_op() == BINARY_ASSIGN)
 	{
@@ -316,10 +681,8 @@ Value* LLVM_IR_code_generator::build_binary_op(const binary_operator_ast* bin)
 		print_and_return_nullptr_if_check_fail(
 			search_result != named_var.cend(),
 			"unknown variable name %s\n", dest_var_name.c_str());
-		//生成rhs的值
-		Value *val = build_expr(bin->get_rhs().get());
-		print_and_return_nullptr_if_check_fail(val != nullptr, 
-			"failed to build value for %s =\n", dest_var_name.c_str());
+		//rhs的值
+		Value *val = operands[0];
 		//赋值的动作属于= operator，需要发射对应的调试信息位置
 		emit_location(bin->get_loc());
 		//写入rhs的值到lhs的变量中
@@ -328,14 +691,19 @@ Value* LLVM_IR_code_generator::build_binary_op(const binary_operator_ast* bin)
 		return val;
 	}
 
+/*
+core_operator中的','就是依次求值后返回rhs，直接展开省去一次call。
+这样rhs中的调用也能处于尾调用位置。
+*/
+	if (bin->get_op() == BINARY_USER_DEFINED
+		&& find_core_op(bin->get_op_external_name()) == CORE_OP_SEQUENCE)
+		return operands[1];
+
 //除开=外的binary公用发射模式
-	auto lhs = build_expr(bin->get_lhs().get());
-	print_and_return_nullptr_if_check_fail(lhs != nullptr,
-		"failed build lhs of binary operator\n");
-	auto rhs = build_expr(bin->get_rhs().get());
-	print_and_return_nullptr_if_check_fail(rhs != nullptr,
-		"failed build lhs of binary operator\n");
+	auto lhs = operands[0];
+	auto rhs = operands[1];
 	Value* cmp;
+	CallInst* call;
 	Function *user_func;
 	const string* op_external_name;
 	//binary_op的操作只包含运算部分，调试信息起点在这里
@@ -361,21 +729,28 @@ Value* LLVM_IR_code_generator::build_binary_op(const binary_operator_ast* bin)
 				err_print(true, "can not find prototype of binary operator %s,"
 				"aborting\n", op_external_name->c_str()); 
 
-			return ir_builder.CreateCall(user_func, {lhs, rhs}, 
+			call = ir_builder.CreateCall(user_func, {lhs, rhs}, 
 				op_external_name->c_str());
+			call->setCallingConv(user_func->getCallingConv());
+			return call;
 		case BINARY_UNKNOWN:
 		default:
 			err_print(true, "unknown binary op, aborting\n");
 	}
+	return nullptr;
 }
 
 
 Value* LLVM_IR_code_generator::build_unary_op(const unary_operator_ast* unary)
+{
+	return build_expr(unary);
+}
+
+Value* LLVM_IR_code_generator::emit_unary_op(const unary_operator_ast* unary,
+	ArrayRef<Value *> operands)
 {
 	//目前都是自定义的uanry，暂时不做通用的流程
-	auto operand = build_expr(unary->get_operand().get());
-	print_and_return_nullptr_if_check_fail(operand != nullptr,
-		"failed build operand of unary operator\n");
+	auto operand = operands[0];
 
 	const string& op_external_name = unary->get_op_external_name();
 	Function* user_func = the_module->getFunction(op_external_name);
@@ -387,25 +762,255 @@ Value* LLVM_IR_code_generator::build_unary_op(const unary_operator_ast* unary)
 
 	//unaryop本身只有这条call语句
 	emit_location(unary->get_loc());
-	return ir_builder.CreateCall(user_func, {operand},
+	CallInst* call = ir_builder.CreateCall(user_func, {operand},
 		op_external_name.c_str());
+	call->setCallingConv(user_func->getCallingConv());
+	return call;
 }
 
+/*
+只有通过prepare_builtin_operator导入的extern声明，才能确认其语义与
+src/lib/core_operator中的定义一致(parser不允许重定义operator)。
+如果operator在本module中有定义(例如编译core_operator自身，或者测试代码
+自己定义了!)，就不能假设其语义，仍然按照普通call处理。
+*/
+LLVM_IR_code_generator::core_op_type
+LLVM_IR_code_generator::find_core_op(const string& op_external_name)
+{
+	if (!global_flags.builtin_core_operator)
+		return CORE_OP_UNKNOWN;
+
+	Function* op_func = the_module->getFunction(op_external_name);
+	if (op_func == nullptr || !op_func->isDeclaration())
+		return CORE_OP_UNKNOWN;
 
-Value* LLVM_IR_code_generator::build_if(const if_ast* if_expr)
+	//名称中植入了优先级，需与prepare_builtin_operator中的声明保持一致
+	static const std::pair<string, core_op_type> core_ops[] =
+	{
+		{prototype_ast::build_operator_external_name(1, "!"), CORE_OP_NOT},
+		{prototype_ast::build_operator_external_name(2, "|", 5), CORE_OP_OR},
+		{prototype_ast::build_operator_external_name(2, ">", 10),
+			CORE_OP_GREATER},
+		{prototype_ast::build_operator_external_name(2, "==", 9),
+			CORE_OP_EQUAL},
+		{prototype_ast::build_operator_external_name(2, ",", 1),
+			CORE_OP_SEQUENCE},
+	};
+	for (const auto& op : core_ops)
+	{
+		if (op.first == op_external_name)
+			return op.second;
+	}
+	return CORE_OP_UNKNOWN;
+}
+
+/*
+build_cond用于发射作为分支条件的expr，直接返回i1类型的值。
+原来的做法是build_expr先得到double(比较的结果还要uitofp一次)，
+再用fcmp one与0.0比较转回bool，每个条件都要付出比较、转换、再比较的代价。
+这里对比较和逻辑运算的子树直接生成i1，只有其结果作为数值使用时
+(走build_binary_op)才需要物化为double。
+其他expr仍然是求值后与0.0比较，比较指令的loc和名称由调用者给出。
+
+core_operator中各逻辑运算的展开依据如下：
+!v			:	if v then 0 else 1，即not(v one 0)
+a | b		:	两侧都会被求值(不短路)，即(a one 0) or (b one 0)
+a > b		:	b < a，即fcmp ugt a b
+a == b	:	!(a < b | a > b)，ult与ugt的或是une，取反后即fcmp oeq a b
+*/
+Value* LLVM_IR_code_generator::build_cond(const expr_ast* cond,
+	const source_location& loc, const char* name)
 {
+	ast_scope_guard ast_guard(cur_ast, cond);
+	Value* lhs;
+	Value* rhs;
+	if (cond->get_type() == BINARY_OPERATOR_AST)
+	{
+		auto bin = (const binary_operator_ast*)cond;
+		auto core_op = CORE_OP_UNKNOWN;
+		if (bin->get_op() == BINARY_USER_DEFINED)
+			core_op = find_core_op(bin->get_op_external_name());
+
+		if (bin->get_op() == BINARY_LESS_THAN
+			|| (core_op != CORE_OP_UNKNOWN && core_op != CORE_OP_SEQUENCE))
+		{
+			//|的两个操作数自身也是条件，其余的操作数需要求值
+			if (core_op == CORE_OP_OR)
+			{
+				lhs = build_cond(bin->get_lhs().get(), bin->get_loc(), "orlhs");
+				print_and_return_nullptr_if_check_fail(lhs != nullptr,
+					"failed build lhs of binary operator\n");
+				rhs = build_cond(bin->get_rhs().get(), bin->get_loc(), "orrhs");
+				print_and_return_nullptr_if_check_fail(rhs != nullptr,
+					"failed build rhs of binary operator\n");
+			}
+			else
+			{
+				lhs = build_expr(bin->get_lhs().get());
+				print_and_return_nullptr_if_check_fail(lhs != nullptr,
+					"failed build lhs of binary operator\n");
+				rhs = build_expr(bin->get_rhs().get());
+				print_and_return_nullptr_if_check_fail(rhs != nullptr,
+					"failed build rhs of binary operator\n");
+			}
+			emit_location(bin->get_loc());
+			switch (core_op)
+			{
+				case CORE_OP_OR:
+					return ir_builder.CreateOr(lhs, rhs, "ortmp");
+				case CORE_OP_GREATER:
+					return ir_builder.CreateFCmpUGT(lhs, rhs, "cmptmp");
+				case CORE_OP_EQUAL:
+					return ir_builder.CreateFCmpOEQ(lhs, rhs, "cmptmp");
+				default:
+					return ir_builder.CreateFCmpULT(lhs, rhs, "cmptmp");
+			}
+		}
+	}
+	else if (cond->get_type() == UNARY_OPERATOR_AST)
+	{
+		auto unary = (const unary_operator_ast*)cond;
+		if (find_core_op(unary->get_op_external_name()) == CORE_OP_NOT)
+		{
+			Value* operand = build_cond(unary->get_operand().get(),
+				unary->get_loc(), "nottmp");
+			print_and_return_nullptr_if_check_fail(operand != nullptr,
+				"failed build operand of unary operator\n");
+			emit_location(unary->get_loc());
+			return ir_builder.CreateNot(operand, "nottmp");
+		}
+	}
 
-	Value *cond_val = build_expr(if_expr->get_cond().get());
+	Value* cond_val = build_expr(cond);
+	print_and_return_nullptr_if_check_fail(cond_val != nullptr,
+		"can not build condition expr\n");
+	emit_location(loc);
+	// Convert condition to a bool by comparing non-equal to 0.0.
+	return ir_builder.CreateFCmpONE(cond_val,
+		ConstantFP::get(the_context, APFloat(0.0)), name);
+}
+
+
+/*
+估算expr改为无条件执行时的代价，返回-1表示不能无条件执行。
+只接受常量、变量读取和内置的+-*<运算：
+赋值有副作用；call和自定义operator可能有副作用，也可能很昂贵。
+*/
+int LLVM_IR_code_generator::get_select_cost(const expr_ast* expr)
+{
+	//分支可能是很深的运算树，与build_expr一样用显式的栈遍历
+	int cost = 0;
+	SmallVector<const expr_ast*, 16> work_list{expr};
+	while (!work_list.empty())
+	{
+		const expr_ast* cur = work_list.pop_back_val();
+		switch (cur->get_type())
+		{
+			case NUMBER_AST:
+				break;
+			case VARIABLE_AST:
+				cost += 1;
+				break;
+			case BINARY_OPERATOR_AST:
+			{
+				auto bin = (const binary_operator_ast*)cur;
+				auto op = bin->get_op();
+				if (op != BINARY_ADD && op != BINARY_SUB
+					&& op != BINARY_MUL && op != BINARY_LESS_THAN)
+					return -1;
+				cost += 1;
+				work_list.push_back(bin->get_lhs().get());
+				work_list.push_back(bin->get_rhs().get());
+				break;
+			}
+			default:
+				return -1;
+		}
+	}
+	return cost;
+}
+
+bool LLVM_IR_code_generator::should_lower_to_select(const if_ast* if_expr)
+{
+/*
+两个分支都会被执行，所以单个分支的代价不能太高。
+一次分支预测失败大约十几个周期，几条浮点运算是划算的。
+*/
+	const int max_arm_cost = 4;
+	//if_select： 0 按代价选择，1 总是生成分支，2 只要无副作用就select
+	if (global_flags.if_select == 1)
+		return false;
+
+	int then_cost = get_select_cost(if_expr->get_then().get());
+	int else_cost = get_select_cost(if_expr->get_else().get());
+	if (then_cost < 0 || else_cost < 0)
+		return false;
+	if (global_flags.if_select == 2)
+		return true;
+	//用户给出了概率提示，说明分支是可预测的，保留分支
+	if (if_expr->get_hint() != BRANCH_HINT_NONE)
+		return false;
+	return then_cost <= max_arm_cost && else_cost <= max_arm_cost;
+}
+
+/*
+将分支概率提示转换为!prof metadata，权重与clang的__builtin_expect一致。
+后端据此把热路径排布为fallthrough，冷的分支移出热代码。
+*/
+MDNode* LLVM_IR_code_generator::get_branch_weights(branch_hint hint)
+{
+	const uint32_t likely_weight = 2000;
+	const uint32_t unlikely_weight = 1;
+	MDBuilder md_builder(the_context);
+	switch (hint)
+	{
+		case BRANCH_HINT_LIKELY:
+			return md_builder.createBranchWeights(likely_weight,
+				unlikely_weight);
+		case BRANCH_HINT_UNLIKELY:
+			return md_builder.createBranchWeights(unlikely_weight,
+				likely_weight);
+		case BRANCH_HINT_NONE:
+		default:
+			return nullptr;
+	}
+}
+
+Value* LLVM_IR_code_generator::build_if(const if_ast* if_expr)
+{
+	//cond直接生成i1，比较运算无需再转成double后与0.0比较
+	Value *cond_val = build_cond(if_expr->get_cond().get(),
+		if_expr->get_loc(), "ifcond");
 	print_and_return_nullptr_if_check_fail(cond_val != nullptr,
 		"can not build condition expr for if\n");
 /*
-上面的build_expr会改变loc，原示例中放函数头部会导致比较和跳转指向cond的loc。
-下面的比较和跳转指令是属于if的指令，其loc应该是if表达式的start位置。
+上面的build_cond会改变loc，原示例中放函数头部会导致比较和跳转指向cond的loc。
+下面的跳转指令是属于if的指令，其loc应该是if表达式的start位置。
 */
 	emit_location(if_expr->get_loc());
-	// Convert condition to a bool by comparing non-equal to 0.0.
-	cond_val = ir_builder.CreateFCmpONE(cond_val,
-		ConstantFP::get(the_context, APFloat(0.0)), "ifcond");
+
+/*
+then和else都是无副作用的简单计算时，直接两边都算出来再select。
+这样后端可以生成cmov/blend，避免数据不可预测时的分支预测失败。
+*/
+	if (should_lower_to_select(if_expr))
+	{
+		Value* then_val = build_expr(if_expr->get_then().get());
+		print_and_return_nullptr_if_check_fail(then_val != nullptr,
+			"can not build then expr for if\n");
+		Value* else_val = build_expr(if_expr->get_else().get());
+		print_and_return_nullptr_if_check_fail(else_val != nullptr,
+			"can not build else expr for if\n");
+		emit_location(if_expr->get_loc());
+		Value* select = ir_builder.CreateSelect(cond_val, then_val, else_val,
+			"if_select");
+		//常量条件的select会被直接折叠，不一定是指令
+		MDNode* weights = get_branch_weights(if_expr->get_hint());
+		if (auto select_inst = dyn_cast<Instruction>(select);
+			select_inst && weights)
+			select_inst->setMetadata(LLVMContext::MD_prof, weights);
+		return select;
+	}
 
 	//我们保存到当前正在编译的函数指针在cur_func中，无需下面的语句
 	//Function *TheFunction = Builder.GetInsertBlock()->getParent();
@@ -447,8 +1052,9 @@ PHI操作是完成IF逻辑的关键点。在具体实现时，
 	BasicBlock *then_bb = BasicBlock::Create(the_context, "then", cur_func);
 	BasicBlock *else_bb = BasicBlock::Create(the_context, "else");
 	BasicBlock *merge_bb = BasicBlock::Create(the_context, "if_final");
-//创建条件跳转
-	ir_builder.CreateCondBr(cond_val, then_bb, else_bb);
+//创建条件跳转，有概率提示时附上branch weights供后端排布bb
+	ir_builder.CreateCondBr(cond_val, then_bb, else_bb,
+		get_branch_weights(if_expr->get_hint()));
 
 	// emit then_bb中的expr计算指令获取其val
 	ir_builder.SetInsertPoint(then_bb);
@@ -611,9 +1217,11 @@ fixme!!!
 但是idt_var不是ast，直接记录的是string。
 考虑idt的声明和赋值一般都在同一行，暂时没有修改。
 */
+	emit_lifetime_start(idt_var);
+	scoped_allocas.push_back(idt_var);
 	ir_builder.CreateStore(start_val, idt_var);
 	//发射idt_var的调试信息声明
-	if (debug_info)
+	if (debug_info && debug_info->is_full())
 	{
 /*
 fixme!!!
@@ -686,19 +1294,17 @@ after_loop:
 		named_var[idt_name] = idt_var;
 	//修改named_var后，idt_name这个名称现在指向for中的定义
 
-	// Compute the end condition.
-	Value* end_cond = build_expr(for_expr->get_end().get());
+	// Compute the end condition，直接得到bool
+	Value* end_cond = build_cond(for_expr->get_end().get(),
+		for_expr->get_loc(), "loopcond");
 	print_and_return_nullptr_if_check_fail(end_cond != nullptr,
 		"can not build end expr in for_exp\n");
 
 /*
-比较、跳转和操作idt 变量都是从属于for表达式的指令。
+跳转和操作idt 变量都是从属于for表达式的指令。
 原示例放到函数头部去emit，会导致这些指令从属于cond等表达式。
 */
 	emit_location(for_expr->get_loc());
-	//这里end_cond被改写成bool
-	end_cond = ir_builder.CreateFCmpONE(
-		end_cond, ConstantFP::get(the_context, APFloat(0.0)), "loopcond");
 	//循环持续条件为true则跳转到循环体，否则跳出循环
 	ir_builder.CreateCondBr(end_cond, loop_bb, after_loop_bb);
 
@@ -735,6 +1341,8 @@ after_loop:
 //设置插入点到after_loop_bb，后续指令发射就到循环后面了
 	cur_func->getBasicBlockList().push_back(after_loop_bb);
 	ir_builder.SetInsertPoint(after_loop_bb);
+	emit_lifetime_end(idt_var);
+	scoped_allocas.pop_back();
 
 	// Restore the unshadowed variable.
 	if (old_val != nullptr)
@@ -784,6 +1392,8 @@ map没有提供浅拷贝的实现。
 			"failed to allocate stack for %s\n", var_name.c_str());
 		//发射变量初始值的行号位置
 		emit_location(value_vec[i]->get_loc());
+		emit_lifetime_start(var_alloca);
+		scoped_allocas.push_back(var_alloca);
 		ir_builder.CreateStore(var_value, var_alloca);
 		var_allocas.push_back(var_alloca);
 		if (auto it = named_var.find(var_name); it != named_var.end())
@@ -796,8 +1406,8 @@ map没有提供浅拷贝的实现。
 			named_var[var_name] = var_allocas[i];
 	}
 
-	//如果需要发射调试信息，var中的局部变量需要声明
-	if (debug_info)
+	//如果需要发射完整的调试信息，var中的局部变量需要声明
+	if (debug_info && debug_info->is_full())
 	{
 /*
 fixme!!!
@@ -833,6 +1443,11 @@ fixme!!!
 	print_and_return_nullptr_if_check_fail(body != nullptr, 
 		"failed to build body for var ast\n");
 
+//body已经求值完毕，结束本var声明变量的lifetime
+	for (auto var_alloca : var_allocas)
+		emit_lifetime_end(var_alloca);
+	scoped_allocas.resize(scoped_allocas.size() - var_allocas.size());
+
 //恢复named_var
 	for (size_t i = 0; i < saved_name_vec.size(); ++i)
 	{
@@ -854,8 +1469,42 @@ AllocaInst* LLVM_IR_code_generator::create_alloca_at_func_entry(Function* func,
 {
 	IRBuilder<> tmp_builder (&func->getEntryBlock(),
 		func->getEntryBlock().begin());
-	return tmp_builder.CreateAlloca(Type::getDoubleTy(the_context), 0,
+	auto alloca = tmp_builder.CreateAlloca(Type::getDoubleTy(the_context), 0,
 		var_name.c_str());
+	//tmp_builder不经过ir_builder的inserter，需要单独打标签
+	tag_instruction(alloca);
+	return alloca;
+}
+
+void LLVM_IR_code_generator::tag_instruction(Instruction* inst)
+{
+	if (!attribution || cur_ast == nullptr)
+		return;
+	uint64_t id = cur_ast->get_id();
+	ir_attribution::tag(inst, id);
+	ast_origins.try_emplace(id,
+		ast_origin{cur_ast->get_type(), cur_ast->get_line(), cur_ast->get_col(),
+			cur_ast->get_loc().file_name});
+}
+
+/*
+var/for的变量都在函数入口alloca，如果不标记lifetime，
+它们在整个函数中都是活跃的，前后不相交的作用域也无法共用stack slot。
+在作用域开始和结束处发射llvm.lifetime.start/end，
+后端的stack coloring就能把互不重叠的变量合并到同一个slot。
+*/
+void LLVM_IR_code_generator::emit_lifetime_start(AllocaInst* alloca)
+{
+	auto size = the_module->getDataLayout().getTypeAllocSize(
+		alloca->getAllocatedType());
+	ir_builder.CreateLifetimeStart(alloca, ir_builder.getInt64(size));
+}
+
+void LLVM_IR_code_generator::emit_lifetime_end(AllocaInst* alloca)
+{
+	auto size = the_module->getDataLayout().getTypeAllocSize(
+		alloca->getAllocatedType());
+	ir_builder.CreateLifetimeEnd(alloca, ir_builder.getInt64(size));
 }
 
 void LLVM_IR_code_generator::print_IR()
@@ -889,34 +1538,82 @@ void LLVM_IR_code_generator::print_IR_to_file(string& filename)
 	the_module->print(out_stream, nullptr);
 }
 
-llvm_debug_info::llvm_debug_info(Module* mod, const string& source)
+llvm_debug_info::llvm_debug_info(Module* module, const string& source,
+	debug_info_level lv) : level(lv), mod(module)
+{
+	auto& unit = create_unit(get_unit_key(source));
+	main_unit = cur_unit = &unit;
+	DBuilder = unit.builder;
+	compile_unit = unit.compile_unit;
+	file = unit.file;
+	double_type = unit.double_type;
+}
+
+string llvm_debug_info::get_unit_key(const string& source)
 {
-	DBuilder = new DIBuilder(*mod);
-	namespace fs = std::filesystem;
-	fs::path src_path(source);
 	std::error_code ec;
-	src_path = fs::canonical(src_path, ec);
+	auto src_path = std::filesystem::canonical(source, ec);
+	return ec ? string() : src_path.native();
+}
+
+llvm_debug_info::debug_unit& llvm_debug_info::create_unit(const string& key)
+{
+	namespace fs = std::filesystem;
 	string src_dir = "_uninitilized_";
 	string src_file = "_uninitilized_";
-	if (!ec)
+	if (!key.empty())
 	{
+		fs::path src_path(key);
 		src_dir = src_path.parent_path().native();
 		src_file = src_path.filename().native();
 	}
 
+	auto& unit = units[key];
+	unit.builder = new DIBuilder(*mod);
 /*
 没有设置语言abi的情况下，LLVM默认按照C方式配置ABI，第一个选项为DW_LANG_C。
 第四个选项不是指有没有开启编译优化，应该是给调试器用的信息(
 参考https://reviews.llvm.org/D41985)。所以维持原示例的false设置。
 第五个runtime version还不存在，所以设置为0.
+第七个参数之后是split debug文件名和emission kind，
+line tables级别对应LineTablesOnly，后端只生成.debug_line和最简的subprogram。
 */
-	compile_unit = DBuilder->createCompileUnit(dwarf::DW_LANG_C,
-		DBuilder->createFile(src_file, src_dir), "Kaleidoscope Compiler",
-		false, "", 0);
-	double_type = DBuilder->createBasicType("double",
+	unit.file = unit.builder->createFile(src_file, src_dir);
+	auto emission_kind = level == DEBUG_INFO_FULL ?
+		DICompileUnit::FullDebug : DICompileUnit::LineTablesOnly;
+	unit.compile_unit = unit.builder->createCompileUnit(dwarf::DW_LANG_C,
+		unit.file, "Kaleidoscope Compiler", false, "", 0, StringRef(),
+		emission_kind);
+	unit.double_type = unit.builder->createBasicType("double",
 		64, dwarf::DW_ATE_float);
-	assert(compile_unit != nullptr);
-	assert(double_type != nullptr);
+	assert(unit.compile_unit != nullptr);
+	assert(unit.double_type != nullptr);
+	return unit;
+}
+
+void llvm_debug_info::select_unit(const string& source)
+{
+	string key = get_unit_key(source);
+	auto it = units.find(key);
+	debug_unit* unit;
+	if (it != units.end())
+		unit = &(it->second);
+	else if (key.empty())
+		unit = main_unit;
+	else
+		unit = &create_unit(key);
+
+	cur_unit = unit;
+	DBuilder = unit->builder;
+	compile_unit = unit->compile_unit;
+	file = unit->file;
+	double_type = unit->double_type;
+}
+
+void llvm_debug_info::finalize()
+{
+	for (auto& unit : units)
+		unit.second.builder->finalize();
 }
 
 void LLVM_IR_code_generator::emit_location(const source_location& loc)
@@ -937,9 +1634,38 @@ void LLVM_IR_code_generator::emit_location(const source_location& loc)
 
 }
 
+/*
+line tables级别不需要参数类型，所有函数共用一个空的subroutine type，
+与clang -gline-tables-only的做法一致。
+*/
+DISubroutineType* llvm_debug_info::get_subroutine_type(unsigned num_args)
+{
+	if (level != DEBUG_INFO_FULL)
+		num_args = 0;
+	auto& subroutine_types = cur_unit->subroutine_types;
+	if (num_args < subroutine_types.size() && subroutine_types[num_args])
+		return subroutine_types[num_args];
+
+	SmallVector<Metadata *, 8> elt_types;
+	if (level == DEBUG_INFO_FULL)
+	{
+		// Add the result type.
+		elt_types.push_back(double_type);
+		for (unsigned i = 0; i != num_args; ++i)
+			elt_types.push_back(double_type);
+	}
+	auto type = DBuilder->createSubroutineType(
+		DBuilder->getOrCreateTypeArray(elt_types));
+	if (num_args >= subroutine_types.size())
+		subroutine_types.resize(num_args + 1, nullptr);
+	subroutine_types[num_args] = type;
+	return type;
+}
+
 llvm_debug_info::~llvm_debug_info()
 {
-	delete DBuilder;
+	for (auto& unit : units)
+		delete unit.second.builder;
 }
 
 }	//end of toy_compiler
\ No newline at end of file
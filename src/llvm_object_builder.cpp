@@ -1,7 +1,12 @@
 #include "llvm_target.h"	//for  get_native_target
 #include "llvm/IR/LegacyPassManager.h"	//for llvm::legacy::PassManager
+#include "llvm/Transforms/IPO.h"	//for createWriteThinLTOBitcodePass
 #include "llvm/IR/Module.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Object/ObjectFile.h"	//for section sizes
+#include "llvm/Support/MemoryBuffer.h"
+#include "flags.h"	//for global_flags.split_dwarf
+#include <filesystem>
 /*
 本文件用于将Module对应的IR生成到object文件中
 */
@@ -19,7 +24,35 @@ bool build_object(string& object_name, Module* module)
 		return false;
 	}
 
-	auto target = llvm_target::get_native_target();
+/*
+split dwarf模式下，调试信息的主体写到object旁边的.dwo中，
+object里只剩下skeleton CU和行号表，链接时不再搬运这些调试数据。
+skeleton中记录的dwo名字使用绝对路径，因为CU的comp_dir是源文件所在目录，
+而不一定是当前的工作目录，gdb按照comp_dir+dwo名字查找时会找不到相对路径。
+module中没有调试信息时不拆分，避免产生空的dwo文件。
+*/
+	string dwo_name;
+	std::unique_ptr<raw_fd_ostream> dwo_stream;
+	if (global_flags.split_dwarf && !module->debug_compile_units().empty())
+	{
+		namespace fs = std::filesystem;
+		fs::path dwo_path(object_name);
+		dwo_path.replace_extension(".dwo");
+		dwo_name = fs::absolute(dwo_path, err).native();
+		if (!err)
+			dwo_stream = std::make_unique<raw_fd_ostream>(dwo_name, err);
+		if (err)
+		{
+			err_print(false, "can not open %s, reason:%s\n",
+				dwo_name.c_str(), err.message().c_str());
+			return false;
+		}
+	}
+
+	//链接时按照symbol_order重排函数，需要每个函数在单独的section中
+	auto target = llvm_target::get_native_target(dwo_name,
+		global_flags.size_opt,
+		global_flags.function_sections || global_flags.symbol_order);
 /*
 必须设置（尤其是setTargetTriple）。
 在无优化情况下，module没有设置过TargetTriple，codegen会报错。
@@ -29,16 +62,116 @@ bool build_object(string& object_name, Module* module)
 	llvm::legacy::PassManager pass;
 	auto FileType = CGFT_ObjectFile;
 
-	if (target->addPassesToEmitFile(pass, out_stream, nullptr, FileType)) {
+	if (target->addPassesToEmitFile(pass, out_stream, dwo_stream.get(),
+		FileType)) {
 		errs() << "TargetMachine can't emit a file of this type";
 		return false;
 	}
 
 	pass.run(*module);
 	out_stream.flush();
+	if (dwo_stream)
+		dwo_stream->flush();
 	delete target;
 	return true;
 }
 
 
+//object中所有代码段的大小之和
+static bool get_text_size(MemoryBufferRef buffer, uint64_t& text_size)
+{
+	auto obj = object::ObjectFile::createObjectFile(buffer);
+	if (!obj)
+	{
+		err_print(false, "can not read object %s: %s\n",
+			buffer.getBufferIdentifier().str().c_str(),
+			toString(obj.takeError()).c_str());
+		return false;
+	}
+	text_size = 0;
+	for (const auto& section : (*obj)->sections())
+	{
+		if (section.isText())
+			text_size += section.getSize();
+	}
+	return true;
+}
+
+bool get_object_text_size(const string& object_name, uint64_t& text_size)
+{
+	auto buffer = MemoryBuffer::getFile(object_name);
+	if (!buffer)
+	{
+		err_print(false, "can not open %s, reason:%s\n",
+			object_name.c_str(), buffer.getError().message().c_str());
+		return false;
+	}
+	return get_text_size((*buffer)->getMemBufferRef(), text_size);
+}
+
+/*
+在内存中生成object并统计代码段大小，用于与其他优化配置对比。
+后端的CodeGenPrepare等pass会修改IR，所以通常对module的副本调用。
+*/
+bool get_module_text_size(Module* module, uint64_t& text_size,
+	bool machine_outliner)
+{
+	auto target = llvm_target::get_native_target(string(), machine_outliner);
+	module->setDataLayout(target->createDataLayout());
+	module->setTargetTriple(target->getTargetTriple().str());
+	SmallVector<char, 0> object_buffer;
+	raw_svector_ostream out_stream(object_buffer);
+	llvm::legacy::PassManager pass;
+	bool emit_err = target->addPassesToEmitFile(pass, out_stream, nullptr,
+		CGFT_ObjectFile);
+	if (!emit_err)
+		pass.run(*module);
+	delete target;
+	if (emit_err)
+	{
+		errs() << "TargetMachine can't emit a file of this type";
+		return false;
+	}
+	return get_text_size(MemoryBufferRef(StringRef(object_buffer.data(),
+		object_buffer.size()), module->getName()), text_size);
+}
+
+/*
+ThinLTO模式下输出的不是native object，而是带有module summary的bitcode。
+summary记录了每个函数的大小、调用边和引用，链接时的thin link只读summary
+就能决定跨module导入哪些函数，之后每个module的backend可以并行执行。
+文件名仍然沿用.o，lld等支持LTO的链接器按文件内容识别bitcode。
+*/
+bool build_thin_lto_bitcode(string& object_name, Module* module)
+{
+	std::error_code err;
+	raw_fd_ostream out_stream(object_name, err);
+	if (err)
+	{
+		err_print(false, "can not open %s, reason:%s\n", 
+			object_name.c_str(), err.message().c_str());
+		return false;
+	}
+
+	//链接时的backend依据triple和datalayout选择目标
+	auto target = llvm_target::get_native_target();
+	module->setDataLayout(target->createDataLayout());
+	module->setTargetTriple(target->getTargetTriple().str());
+	delete target;
+
+	llvm::legacy::PassManager pass;
+	pass.add(createWriteThinLTOBitcodePass(out_stream));
+	pass.run(*module);
+	out_stream.flush();
+	if (out_stream.has_error())
+	{
+		err_print(false, "can not write %s, reason:%s\n",
+			object_name.c_str(), out_stream.error().message().c_str());
+		//不清除错误的话，raw_fd_ostream析构时会报fatal error
+		out_stream.clear_error();
+		return false;
+	}
+	return true;
+}
+
 }
\ No newline at end of file
@@ -5,7 +5,20 @@
 #include "llvm/Transforms/Scalar/SimplifyCFG.h" //for SimplifyCFGPass
 #include "llvm/Transforms/Scalar.h"	//for createReassociatePass and createCFGSimplificationPass
 #include "llvm/Transforms/InstCombine/InstCombine.h"	//for createInstructionCombiningPass
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"	//for LoopUnrollPass
 #include "llvm/Analysis/OptimizationRemarkEmitter.h" //for OptimizationRemarkEmitterAnalysis
+#include "llvm/Support/FileSystem.h"	//for sys::fs::exists
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Bitcode/BitcodeReader.h"	//for parseBitcodeFile
+#include "llvm/Bitcode/BitcodeWriter.h"	//for WriteBitcodeToFile
+#include "llvm/IR/DebugInfo.h"	//for DebugInfoFinder
+#include "llvm/IR/DebugInfoMetadata.h"	//for DICompileUnit
+#include "llvm/Linker/Linker.h"	//for linkModules
+#include "llvm/Transforms/Utils/Cloning.h"	//for CloneModule
+#include "llvm/Transforms/Utils/SplitModule.h"	//for SplitModule
+#include <algorithm>
+#include <map>
+#include <thread>
 #include "llvm_target.h"
 /*
 本文件用于建模调用LLVM的optimizer优化(codegen生成的)LLVM-IR的行为。
@@ -19,109 +32,439 @@ LLVM提供了多种预制的组合，将各个层级各种功能（pass不都是
 也有分析打印等）的pass有机串连起来，对外提供O2等标准优化包。
 
 本文件实现了两个基本功能：
-optimize_module 用于对当前module进行LLVM的O2优化
-optimize_function 用于重现原示例中的简单函数级组合优化
+optimize(Module&) 用于对当前module进行LLVM的O2优化
+optimize(Function&) 用于重现原示例中的简单函数级组合优化
+optimize_adaptive(Module&) 按函数的大小和热度调整优化力度后进行module优化
+optimize_module_parallel 把module划分为多个分区并行优化
+optimize_size(Module&) 体积优先的优化，用于大部分代码都是冷代码的程序
+optimize_module/optimize_function是对应的单次使用接口。
 */
 namespace toy_compiler{
-void llvm_optimizer::optimize_module(Module& mod , int opt_level)
-{
 /*
-使用PassBuilder提供的buildPerModuleDefaultPipeline接口,
-提供优化级别O2，就可以获得我们需要的优化Pass组合。
 初始化PassBuilder需要提供TargetMachine *作为入参(描述生成代码针对的架构机器)。
-所以整个函数的流程就是：
-先创建TargetMachine *；
-再初始化PassBuilder；
-最后调用PassBuilder.buildPerModuleDefaultPipeline()构建出ModulePassManager
-调用ModulePassManager.run(mod)完成优化
-*/
-
-	TargetMachine * target_machine = llvm_target::get_native_target();
-	/*原示例第8章提到设置一下有助于优化*/
-	mod.setDataLayout(target_machine->createDataLayout());
-	mod.setTargetTriple(target_machine->getTargetTriple().str());
-
-/*新的PassManger用法与原示例有较大区别，下面片段来自
-	tools/opt/NewPMDriver.cpp */
-	class PassBuilder opt_builder(target_machine);
-	LoopAnalysisManager LAM;
-	FunctionAnalysisManager FAM;
-	CGSCCAnalysisManager CGAM;
-	ModuleAnalysisManager MAM;
-
+新的PassManger用法与原示例有较大区别，下面片段来自tools/opt/NewPMDriver.cpp。
 
+函数级优化的流水线没有直接用PassBuilder构建，
+但是没有其提供的registerFunctionAnalyses等接口注册分析pass，
+直接运行func_optimizer会有运行错误。原因推测是这些优化pass需要
+特定分析pass的支持(理论上这个要求是合理的，但需要进一步明确)。
+参考NewPMDriver.cpp中注册全部分析pass的更为稳妥。
+*/
+llvm_optimizer::llvm_optimizer()
+	: target_machine(llvm_target::get_native_target()),
+	opt_builder(target_machine.get(), PipelineTuningOptions(),
+		get_pgo_options())
+{
 	// Register all the basic analyses with the managers.
 	opt_builder.registerModuleAnalyses(MAM);
 	opt_builder.registerCGSCCAnalyses(CGAM);
 	opt_builder.registerFunctionAnalyses(FAM);
 	opt_builder.registerLoopAnalyses(LAM);
 	opt_builder.crossRegisterProxies(LAM, FAM, CGAM, MAM);
-	//llvm的优化级别分别是O0到O3，再加上Os和Oz
-	assert(0 <= opt_level && opt_level <= 5);
-	llvm::PassBuilder::OptimizationLevel opt;
-	switch(opt_level)
+
+	func_optimizer.addPass(InstCombinePass());
+	func_optimizer.addPass(ReassociatePass());
+	func_optimizer.addPass(GVN());
+	func_optimizer.addPass(SimplifyCFGPass());
+}
+
+/*
+两阶段的instrumented PGO：
+1 instrument：默认流水线在早期插入PGOInstrumentationGen和InstrProfiling，
+	每个基本块边上的计数器在程序退出时写入profile_file(默认default.profraw，
+	也可以在运行时用LLVM_PROFILE_FILE环境变量指定)。
+	链接时需要profile runtime，见compiler.sh。
+2 use：llvm-profdata merge得到的profdata由PGOInstrumentationUse读入，
+	转换为分支权重和函数入口计数，内联、块布局和冷热划分都会参考这些数据。
+两个阶段的源码必须一致，否则函数的CFG hash不匹配，对应的profile会被忽略。
+
+采样的PGO(AutoFDO)不需要插桩，直接使用线上程序perf采样的结果：
+3 sample use：perf数据经create_llvm_prof等工具转换为LLVM的sample profile，
+	其中按照函数名和相对函数起始行的行号偏移(以及discriminator)记录采样数。
+	SampleProfileLoader依靠调试信息中的行号把采样映射回IR，
+	所以被采样的程序和本次编译都需要调试信息(debug_info不为0)。
+	DebugInfoForProfiling会在流水线中加入AddDiscriminators，
+	同一行上的多个基本块也能区分开。
+*/
+Optional<PGOOptions> llvm_optimizer::get_pgo_options()
+{
+	string profile_file = global_flags.profile_file;
+	switch ((int)global_flags.pgo)
+	{
+		case 0:
+			return None;
+		case 1:
+			return PGOOptions(profile_file, "", "", PGOOptions::IRInstr);
+		case 2:
+			if (profile_file.empty() || !sys::fs::exists(profile_file))
+			{
+				err_print(false, "can not find profile \"%s\" for pgo=2, "
+					"optimizing without profile\n", profile_file.c_str());
+				return None;
+			}
+			return PGOOptions(profile_file, "", "", PGOOptions::IRUse);
+		case 3:
+			if (profile_file.empty() || !sys::fs::exists(profile_file))
+			{
+				err_print(false, "can not find sample profile \"%s\" for pgo=3, "
+					"optimizing without profile\n", profile_file.c_str());
+				return None;
+			}
+			if (global_flags.debug_info == 0)
+				err_print(false, "pgo=3 needs debug_info to match samples "
+					"to source lines\n");
+			return PGOOptions(profile_file, "", "", PGOOptions::SampleUse,
+				PGOOptions::NoCSAction, true);
+		default:
+			err_print(false, "invalid pgo %d, optimizing without profile\n",
+				(int)global_flags.pgo);
+			return None;
+	}
+}
+
+/*
+分析结果以IR对象的地址为key缓存，优化后的IR已经变化，
+被释放的函数地址还可能被下一个module复用，所以每次运行后都要清空。
+外层的proxy被清除时也会清空内层的manager，这里为了清晰全部显式清空。
+*/
+void llvm_optimizer::clear_analyses()
+{
+	MAM.clear();
+	CGAM.clear();
+	FAM.clear();
+	LAM.clear();
+}
+
+void llvm_optimizer::optimize(Module& mod, int opt_level, bool thin_lto_prelink)
+{
+/*
+使用PassBuilder提供的buildPerModuleDefaultPipeline接口,
+提供优化级别O2，就可以获得我们需要的优化Pass组合。
+每个优化级别的ModulePassManager在第一次使用时构建，之后复用。
+ThinLTO的编译阶段使用buildThinLTOPreLinkDefaultPipeline，
+它推迟了内联后的大部分优化，避免在链接时跨module导入函数后重复优化。
+*/
+	/*原示例第8章提到设置一下有助于优化*/
+	mod.setDataLayout(target_machine->createDataLayout());
+	mod.setTargetTriple(target_machine->getTargetTriple().str());
+
+	assert(is_valid_opt_level(opt_level));
+	auto& mod_optimizer = thin_lto_prelink ?
+		thin_lto_optimizers[opt_level] : module_optimizers[opt_level];
+	if (!mod_optimizer)
 	{
-		case 0: opt = llvm::PassBuilder::OptimizationLevel::O0; break;
-		case 1: opt = llvm::PassBuilder::OptimizationLevel::O1; break;
-		case 2: opt = llvm::PassBuilder::OptimizationLevel::O2; break;
-		case 3: opt = llvm::PassBuilder::OptimizationLevel::O3; break;
-		case 4: opt = llvm::PassBuilder::OptimizationLevel::Os; break;
-		case 5: opt = llvm::PassBuilder::OptimizationLevel::Oz; break;
+		llvm::PassBuilder::OptimizationLevel opt;
+		switch(opt_level)
+		{
+			case 0: opt = llvm::PassBuilder::OptimizationLevel::O0; break;
+			case 1: opt = llvm::PassBuilder::OptimizationLevel::O1; break;
+			case 2: opt = llvm::PassBuilder::OptimizationLevel::O2; break;
+			case 3: opt = llvm::PassBuilder::OptimizationLevel::O3; break;
+			case 4: opt = llvm::PassBuilder::OptimizationLevel::Os; break;
+			case 5: opt = llvm::PassBuilder::OptimizationLevel::Oz; break;
+		}
+		if (thin_lto_prelink)
+			mod_optimizer.emplace(
+				opt_builder.buildThinLTOPreLinkDefaultPipeline(opt));
+		else
+			mod_optimizer.emplace(opt_builder.buildPerModuleDefaultPipeline(opt));
 	}
-	ModulePassManager mod_optimizer = 
-		opt_builder.buildPerModuleDefaultPipeline(opt);
 /*
 新版本的PassManager没有提供doInitialization等方法，所以直接run
 FPM.doInitialization();
 FPM.run(*NonConstF);
 FPM.doFinalization();
 */
+	mod_optimizer->run(mod, MAM);
+	clear_analyses();
+}
 
-	mod_optimizer.run(mod, MAM);
-	delete target_machine;
-	return;
+/*
+自定义的pipeline文本与opt -passes的语法一致，例如
+"function(sroa,instcombine,gvn),globaldce"或者"default<O1>"。
+PassBuilder中的parsePipelineText只是其内部的语法解析，
+对外的入口是parsePassPipeline，它会完成解析并把pass加入MPM。
+*/
+bool llvm_optimizer::optimize(Module& mod, const std::string& pipeline)
+{
+	auto it = custom_optimizers.find(pipeline);
+	if (it == custom_optimizers.end())
+	{
+		ModulePassManager mod_optimizer;
+		if (auto err = opt_builder.parsePassPipeline(mod_optimizer, pipeline))
+		{
+			err_print(false, "can not parse pass pipeline \"%s\": %s\n",
+				pipeline.c_str(), toString(std::move(err)).c_str());
+			return false;
+		}
+		it = custom_optimizers.emplace(pipeline, std::move(mod_optimizer)).first;
+	}
+
+	mod.setDataLayout(target_machine->createDataLayout());
+	mod.setTargetTriple(target_machine->getTargetTriple().str());
+	it->second.run(mod, MAM);
+	clear_analyses();
+	return true;
 }
 
-void llvm_optimizer::optimize_function(Function& func)
+/*
+属性在流水线之前加上，optsize/minsize/optnone由流水线中的各个pass自己识别。
+hot_loops的函数在module优化之后再运行一遍O3的函数简化流水线和O3的循环展开，
+O3的展开阈值更高，热循环可以完全展开。小的热函数此时通常已经内联到调用者中，
+所以调用者也在其中。函数可能已经被内联并删除，需要重新查找。
+*/
+std::map<std::string, adaptive_decision> llvm_optimizer::optimize_adaptive(Module& mod,
+	int opt_level, size_t budget, bool thin_lto_prelink)
 {
+	adaptive_opt_planner planner;
+	int pgo = global_flags.pgo;
+	if (pgo >= 2)
+		planner.load_profile(pgo, global_flags.profile_file, mod.getContext());
+	auto decisions = planner.plan(mod, FAM, budget);
+	FAM.clear();
+	adaptive_opt_planner::apply(mod, decisions);
+	optimize(mod, opt_level, thin_lto_prelink);
+	if (opt_level >= 3 || opt_level == 0)
+		return decisions;
+
+	if (!hot_optimizer)
+	{
+		hot_optimizer.emplace(opt_builder.buildFunctionSimplificationPipeline(
+			PassBuilder::OptimizationLevel::O3, PassBuilder::ThinLTOPhase::None));
+		hot_optimizer->addPass(LoopUnrollPass(LoopUnrollOptions(3)));
+	}
+	for (const auto& item : decisions)
+	{
+		if (!item.second.hot_loops)
+			continue;
+		Function* func = mod.getFunction(item.first);
+		if (func != nullptr && !func->isDeclaration())
+			hot_optimizer->run(*func, FAM);
+	}
+	clear_analyses();
+	return decisions;
+}
+
 /*
-这里前面的PassBuilder没有直接用于构建func_optimizer.
-但是没有其提供的registerFunctionAnalyses等接口注册分析pass，
-直接运行func_optimizer会有运行错误。原因推测是这些优化pass需要
-特定分析pass的支持(理论上这个要求是合理的，但需要进一步明确)。
-参考NewPMDriver.cpp中注册全部分析pass的更为稳妥。
+生成的代码中常有大量几乎相同的函数，冷代码占多数时，更小的代码段
+对i-cache和iTLB更友好，反而更快。
+minsize让内联、循环展开和向量化都按照体积决策，后端也选择更短的指令序列。
+MergeFunctions在Oz之后运行，内联和化简后才能暴露出更多相同的函数，
+external的函数被替换为跳转到保留函数的thunk，之后的globaldce删除无用的internal函数。
+noredzone是x86上machine outliner提取函数体的前提，见llvm_target::get_native_target。
+optnone的函数(adaptive_opt)保持不变。
+ThinLTO的pre-link阶段只做Oz的pre-link流水线，minsize等属性保存在bitcode中，
+由链接时的backend按照体积优化；合并函数产生的thunk会妨碍跨module的导入，
+所以不在pre-link阶段合并。
 */
-	TargetMachine * target_machine = llvm_target::get_native_target();
-/*新的PassManger用法与原示例有较大区别，下面片段来自
-	tools/opt/NewPMDriver.cpp*/
-	class PassBuilder opt_builder(target_machine);
-	LoopAnalysisManager LAM;
-	FunctionAnalysisManager FAM;
-	CGSCCAnalysisManager CGAM;
-	ModuleAnalysisManager MAM;
+bool llvm_optimizer::optimize_size(Module& mod, bool thin_lto_prelink)
+{
+	for (auto& func : mod)
+	{
+		if (func.isDeclaration() || func.hasFnAttribute(Attribute::OptimizeNone))
+			continue;
+		func.addFnAttr(Attribute::OptimizeForSize);
+		func.addFnAttr(Attribute::MinSize);
+		func.addFnAttr(Attribute::NoRedZone);
+	}
+	optimize(mod, 5, thin_lto_prelink);
+	if (thin_lto_prelink)
+		return true;
+	return optimize(mod, "mergefunc,globaldce");
+}
 
+void llvm_optimizer::optimize(Function& func)
+{
+	func_optimizer.run(func, FAM);
+	clear_analyses();
+}
 
-	// Register all the basic analyses with the managers.
-	opt_builder.registerModuleAnalyses(MAM);
-	opt_builder.registerCGSCCAnalyses(CGAM);
-	opt_builder.registerFunctionAnalyses(FAM);
-	opt_builder.registerLoopAnalyses(LAM);
-	opt_builder.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+void llvm_optimizer::optimize_module(Module& mod , int opt_level,
+	bool thin_lto_prelink)
+{
+	llvm_optimizer optimizer;
+	optimizer.optimize(mod, opt_level, thin_lto_prelink);
+}
+
+bool llvm_optimizer::optimize_module(Module& mod, const std::string& pipeline)
+{
+	llvm_optimizer optimizer;
+	return optimizer.optimize(mod, pipeline);
+}
 
 /*
-新版本的PassManager没有提供doInitialization等方法，所以直接run
-FPM.doInitialization();
-FPM.run(*NonConstF);
-FPM.doFinalization();
+每个分区从bitcode读回时都带有一份distinct的compile unit，链接不会合并它们。
+DIFile是uniqued的，同一个源文件的compile unit指向同一个DIFile，
+这里把它们合并到链接后的第一份上：所有subprogram(包括只出现在内联位置中的)
+都指向合并后的compile unit，llvm.dbg.cu按原module的顺序只保留函数仍在引用的。
+unity build中不同文件的compile unit保持独立。
 */
-	FunctionPassManager func_optimizer;
-	func_optimizer.addPass(InstCombinePass());
-	func_optimizer.addPass(ReassociatePass());
-	func_optimizer.addPass(GVN());
-	func_optimizer.addPass(SimplifyCFGPass());
-	func_optimizer.run(func, FAM);
+static void merge_compile_units(Module& mod, const std::vector<DIFile*>& unit_files)
+{
+	DebugInfoFinder finder;
+	finder.processModule(mod);
+	std::map<DIFile*, DICompileUnit*> file_units;
+	for (auto unit : finder.compile_units())
+		file_units.emplace(unit->getFile(), unit);
+	for (auto sub_prog : finder.subprograms())
+	{
+		auto unit = sub_prog->getUnit();
+		if (unit != nullptr && file_units[unit->getFile()] != unit)
+			sub_prog->replaceUnit(file_units[unit->getFile()]);
+	}
+
+	SetVector<DICompileUnit*> used_units;
+	for (const auto& func : mod)
+	{
+		if (auto sub_prog = func.getSubprogram())
+			used_units.insert(sub_prog->getUnit());
+	}
+	auto cu_list = mod.getNamedMetadata("llvm.dbg.cu");
+	if (cu_list == nullptr)
+		return;
+	cu_list->clearOperands();
+	for (auto file : unit_files)
+	{
+		auto it = file_units.find(file);
+		if (it != file_units.end()
+			&& (used_units.empty() || used_units.count(it->second)))
+			cu_list->addOperand(it->second);
+	}
+}
+
+/*
+并行优化的流程与LLVM的splitCodeGen类似：
+1 在整个module上做一次内联，分区后跨分区的调用就不能再内联了
+2 SplitModule把local的函数与引用它的函数聚为一类(PreserveLocals)，
+	再把各类按照IR大小均衡地分配到各个分区，local的函数保持internal。
+	whole_program模式下调用图连通的函数会落在同一个分区里
+3 LLVMContext不是线程安全的，每个分区序列化为bitcode后，
+	在各自线程的context中解析和优化，再序列化回来。
+	创建TargetMachine会修改全局的命令行选项，所以optimizer都在主线程创建
+4 删除原module中的定义，按照分区顺序把结果链接回来，
+	再合并各个分区中重复的compile unit
+jobs为1时同样走完整个流程，只有一个分区，用作衡量并行加速比的基准。
+*/
+static const char* const parallel_prelink_pipeline =
+	"function(sroa,early-cse,instcombine),cgscc(inline),globaldce";
+
+bool llvm_optimizer::optimize_module_parallel(Module& mod, int opt_level,
+	unsigned jobs)
+{
+	jobs = std::max(jobs, 1u);
+	llvm_optimizer prelink_optimizer;
+	if (!prelink_optimizer.optimize(mod, parallel_prelink_pipeline))
+		return false;
+
+	std::vector<SmallVector<char, 0>> partitions;
+	SplitModule(CloneModule(mod), jobs,
+		[&] (std::unique_ptr<Module> part)
+		{
+			partitions.emplace_back();
+			raw_svector_ostream out(partitions.back());
+			WriteBitcodeToFile(*part, out);
+		}, true);
+
+	std::vector<std::unique_ptr<llvm_optimizer>> optimizers;
+	for (size_t i = 0; i < partitions.size(); ++i)
+		optimizers.push_back(std::make_unique<llvm_optimizer>());
+	std::vector<std::string> errors(partitions.size());
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < partitions.size(); ++i)
+	{
+		workers.emplace_back([&, i] ()
+			{
+				LLVMContext part_context;
+				auto& buffer = partitions[i];
+				auto part = parseBitcodeFile(MemoryBufferRef(
+					StringRef(buffer.data(), buffer.size()), "partition"),
+					part_context);
+				if (!part)
+				{
+					errors[i] = toString(part.takeError());
+					return;
+				}
+				optimizers[i]->optimize(**part, opt_level);
+				buffer.clear();
+				raw_svector_ostream out(buffer);
+				WriteBitcodeToFile(**part, out);
+			});
+	}
+	for (auto& worker : workers)
+		worker.join();
+	for (size_t i = 0; i < errors.size(); ++i)
+	{
+		if (!errors[i].empty())
+		{
+			err_print(false, "can not optimize partition %zu: %s\n", i,
+				errors[i].c_str());
+			return false;
+		}
+	}
 
-	delete target_machine;//释放资源否则asan会报大量leak
+/*
+先删除所有函数体和全局变量的初始值，去掉相互之间的引用，再删除这些全局符号。
+如果保留声明，分区中同名的internal函数链接时会被改名。
+*/
+	for (auto& func : mod)
+		func.deleteBody();
+	for (auto& var : mod.globals())
+		var.setInitializer(nullptr);
+	for (auto it = mod.begin(); it != mod.end(); )
+	{
+		Function& func = *it++;
+		if (func.use_empty())
+			func.eraseFromParent();
+	}
+	for (auto it = mod.global_begin(); it != mod.global_end(); )
+	{
+		GlobalVariable& var = *it++;
+		if (var.use_empty())
+			var.eraseFromParent();
+	}
+	std::vector<DIFile*> unit_files;
+	if (auto cu_list = mod.getNamedMetadata("llvm.dbg.cu"))
+	{
+		for (auto unit : cu_list->operands())
+			unit_files.push_back(cast<DICompileUnit>(unit)->getFile());
+		mod.eraseNamedMetadata(cu_list);
+	}
+
+	for (size_t i = 0; i < partitions.size(); ++i)
+	{
+		auto& buffer = partitions[i];
+		auto part = parseBitcodeFile(MemoryBufferRef(
+			StringRef(buffer.data(), buffer.size()), "partition"),
+			mod.getContext());
+		if (!part)
+		{
+			err_print(false, "can not read partition %zu: %s\n", i,
+				toString(part.takeError()).c_str());
+			return false;
+		}
+		//linkModules出错时返回true
+		if (Linker::linkModules(mod, std::move(*part)))
+		{
+			err_print(false, "can not link partition %zu\n", i);
+			return false;
+		}
+	}
+
+	//去掉各个分区留下的、已经没有使用者的声明
+	for (auto it = mod.begin(); it != mod.end(); )
+	{
+		Function& func = *it++;
+		if (func.isDeclaration() && func.use_empty())
+			func.eraseFromParent();
+	}
+	merge_compile_units(mod, unit_files);
+	return true;
+}
+
+void llvm_optimizer::optimize_function(Function& func)
+{
+	llvm_optimizer optimizer;
+	optimizer.optimize(func);
 }
 
 
@@ -12,7 +12,8 @@ using namespace llvm;
 using namespace std;
 
 //为了简单，我们当前只支持本地机器
-TargetMachine* llvm_target::get_native_target()
+TargetMachine* llvm_target::get_native_target(const string& split_dwarf_file,
+	bool machine_outliner, bool function_sections)
 {
 		InitializeNativeTarget();
 		InitializeNativeTargetAsmPrinter();
@@ -27,7 +28,19 @@ TargetMachine* llvm_target::get_native_target()
 		assert(tgt != nullptr);
 		//原示例代码有一些小问题，例如没有初始化Options，RM传参没意义；
 		//所以从llvm的opt.cpp中抄写了下面部分，
-		const TargetOptions Options = InitTargetOptionsFromCodeGenFlags();
+		TargetOptions Options = InitTargetOptionsFromCodeGenFlags();
+		//fastcc的函数在尾调用位置的tail call保证被优化为跳转
+		Options.GuaranteedTailCallOpt = true;
+		//对应clang的-gsplit-dwarf，AsmPrinter看到该名字后会把.debug_info等拆到dwo中
+		Options.MCOptions.SplitDwarfFile = split_dwarf_file;
+		//对应clang的-ffunction-sections
+		Options.FunctionSections = function_sections;
+	/*
+	x86没有默认outlining的函数，outliner要在-enable-machine-outliner=always下
+	才会运行，这个进程级的选项由main在启动时设置。
+	x86上只从带noredzone属性的函数中提取，见llvm_optimizer::optimize_size。
+	*/
+		Options.EnableMachineOutliner = machine_outliner;
 		//before using getCPUStr() and getFeaturesStr() ，设置cpu
 		MCPU = "native";
 
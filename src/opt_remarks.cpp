@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <vector>
+#include "opt_remarks.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/RemarkStreamer.h"	//for setupOptimizationRemarks
+#include "utils.h"
+
+namespace toy_compiler{
+using namespace std;
+
+/*
+missed和analysis两类remark交给record统计，passed的remark只写入文件。
+pass的过滤规则与RemarkStreamer一致，文件和统计看到的是同一批remark。
+handleDiagnostics对remark返回true，context不会再把它们打印到stderr；
+其他诊断信息返回false，仍然走默认的打印流程。
+*/
+class opt_remarks::remark_collector final : public DiagnosticHandler
+{
+	opt_remarks& owner;
+	std::unique_ptr<Regex> pass_filter;
+	bool is_pass_enabled(StringRef pass_name) const
+	{
+		return pass_filter == nullptr || pass_filter->match(pass_name);
+	}
+public:
+	remark_collector(opt_remarks& remarks, const string& passes)
+		: owner(remarks)
+	{
+		if (!passes.empty())
+			pass_filter = std::make_unique<Regex>(passes);
+	}
+	bool handleDiagnostics(const DiagnosticInfo& info) override
+	{
+		auto remark = dyn_cast<DiagnosticInfoOptimizationBase>(&info);
+		if (remark == nullptr)
+			return false;
+		if (remark->isEnabled() && remark->getKind() != DK_OptimizationRemark
+			&& remark->getKind() != DK_MachineOptimizationRemark)
+			owner.record(*remark);
+		return true;
+	}
+	bool isAnalysisRemarkEnabled(StringRef pass_name) const override
+	{
+		return is_pass_enabled(pass_name);
+	}
+	bool isMissedOptRemarkEnabled(StringRef pass_name) const override
+	{
+		return is_pass_enabled(pass_name);
+	}
+	bool isPassedOptRemarkEnabled(StringRef pass_name) const override
+	{
+		return is_pass_enabled(pass_name);
+	}
+	bool isAnyRemarkEnabled() const override {return true;}
+};
+
+opt_remarks::opt_remarks(LLVMContext& ctx) : context(ctx)
+{
+}
+
+opt_remarks::~opt_remarks()
+{
+	//RemarkStreamer引用了文件的输出流，要先于文件释放
+	context.setRemarkStreamer(nullptr);
+	if (saved_handler)
+		context.setDiagnosticHandler(std::move(saved_handler));
+	if (remark_file)
+		remark_file->keep();
+}
+
+bool opt_remarks::setup(const string& file_name, const string& passes,
+	const string& format, bool with_hotness)
+{
+	if (!passes.empty())
+	{
+		string err_msg;
+		if (!Regex(passes).isValid(err_msg))
+		{
+			err_print(false, "invalid remarks pass filter \"%s\": %s\n",
+				passes.c_str(), err_msg.c_str());
+			return false;
+		}
+	}
+/*
+setupOptimizationRemarks会按照format创建serializer，
+把RemarkStreamer挂到context上，with_hotness时remark带上profile中的执行次数。
+它同时校验pass的正则表达式和format，出错时context保持不变。
+*/
+	if (!file_name.empty())
+	{
+		auto file_or_err = setupOptimizationRemarks(context, file_name,
+			passes, format, with_hotness);
+		if (!file_or_err)
+		{
+			err_print(false, "can not write remarks to %s: %s\n",
+				file_name.c_str(), toString(file_or_err.takeError()).c_str());
+			return false;
+		}
+		remark_file = std::move(*file_or_err);
+	}
+	else if (with_hotness)
+		context.setDiagnosticsHotnessRequested(true);
+
+	if (!saved_handler)
+		saved_handler = context.getDiagnosticHandler();
+	context.setDiagnosticHandler(
+		std::make_unique<remark_collector>(*this, passes));
+	return true;
+}
+
+void opt_remarks::record(const DiagnosticInfoOptimizationBase& remark)
+{
+	if (remark.getKind() == DK_OptimizationRemarkMissed
+		|| remark.getKind() == DK_MachineOptimizationRemarkMissed)
+		++missed_num;
+	string key = remark.getKind() == DK_OptimizationRemarkMissed
+		|| remark.getKind() == DK_MachineOptimizationRemarkMissed
+		? "missed " : "analysis ";
+	key += remark.getPassName();
+	key += ":";
+	key += remark.getRemarkName();
+
+	auto& item = summary[remark.getFunction().getName().str()][key];
+	if (item.count++ != 0)
+		return;
+	if (remark.isLocationAvailable())
+	{
+		auto loc = remark.getLocation();
+		item.line = loc.getLine();
+		item.col = loc.getColumn();
+	}
+	item.message = remark.getMsg();
+}
+
+void opt_remarks::print_summary(raw_ostream& out, size_t top_n) const
+{
+	out << "optimization remarks: " << missed_num << " missed in "
+		<< summary.size() << " functions\n";
+	for (const auto& func : summary)
+	{
+		out << "  " << func.first << ":\n";
+		//按照次数从多到少排序，次数相同的保持key的顺序
+		vector<pair<string, remark_summary>> items(func.second.cbegin(),
+			func.second.cend());
+		stable_sort(items.begin(), items.end(),
+			[] (const pair<string, remark_summary>& a,
+				const pair<string, remark_summary>& b)
+			{
+				return a.second.count > b.second.count;
+			});
+		if (items.size() > top_n)
+			items.resize(top_n);
+		for (const auto& item : items)
+		{
+			out << "    " << item.first << "\t" << item.second.count;
+			if (item.second.line != 0)
+				out << "\tline " << item.second.line << ":" << item.second.col;
+			out << "\t" << item.second.message << "\n";
+		}
+	}
+}
+
+}	//end of toy_compiler
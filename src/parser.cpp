@@ -1,4 +1,5 @@
 #include <cassert>
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <sstream>
@@ -99,6 +100,34 @@ prototype有三种格式。
 	string op_sym;
 	double prio;
 	int op_prio = -1;
+
+/*
+函数名前可以有修饰关键字：
+strict/fastmath覆盖全局的fast_math设置；
+nounwind/pure/const声明函数的副作用，同时出现多个时取约束最强的；
+export声明函数在whole_program模式下仍然对外可见。
+*/
+	int fast_math_level = -1;
+	func_purity purity = PURITY_NONE;
+	bool is_exported = false;
+	for ( ; ; cur_token = &get_next_token())
+	{
+		if (*cur_token == TOKEN_STRICT)
+			fast_math_level = 0;
+		else if (*cur_token == TOKEN_FASTMATH)
+			fast_math_level = 3;
+		else if (*cur_token == TOKEN_NOUNWIND)
+			purity = max(purity, PURITY_NOUNWIND);
+		else if (*cur_token == TOKEN_PURE)
+			purity = max(purity, PURITY_PURE);
+		else if (*cur_token == TOKEN_CONST)
+			purity = max(purity, PURITY_CONST);
+		else if (*cur_token == TOKEN_EXPORT)
+			is_exported = true;
+		else
+			break;
+	}
+
 	switch (*cur_token)
 	{
 		case TOKEN_IDENTIFIER:
@@ -198,6 +227,9 @@ pair<string, prototype_t*> 再转为 pair<string_view, prototype_t*>再insert。
 这会导致get_proto_tab中的key 变成一个指向临时stack变量的string_view。
 一定注意make_pair是根据入参确定返回值的，所以要先转换好再传入。
 */
+	ret->set_fast_math_level(fast_math_level);
+	ret->set_purity(purity);
+	ret->set_exported(is_exported);
 	get_proto_tab().insert(make_pair(string_view(ret->get_name()), ret.get()));
 	return ret;
 }
@@ -445,12 +477,20 @@ expr_t parser::parse_paren()
 		return nullptr;
 }
 
-// if的语法为: IF expr THEN expr ELSE expr
+// if的语法为: IF [LIKELY|UNLIKELY] expr THEN expr ELSE expr
 expr_t parser::parse_if() 
 {
 	source_location ast_loc = get_cur_token().get_loc();
 	const token* cur_token;
-	get_next_token();	//吃掉IF
+	cur_token = &get_next_token();	//吃掉IF
+	//可选的分支概率提示，likely表示cond通常为真
+	branch_hint hint = BRANCH_HINT_NONE;
+	if (*cur_token == TOKEN_LIKELY || *cur_token == TOKEN_UNLIKELY)
+	{
+		hint = *cur_token == TOKEN_LIKELY ? BRANCH_HINT_LIKELY
+			: BRANCH_HINT_UNLIKELY;
+		get_next_token();	//吃掉LIKELY/UNLIKELY
+	}
 	const auto& cond = parse_expr();
 	print_and_return_nullptr_if_check_fail(cond != nullptr, 
 		"failed to parse cond expr in if_ast\n");
@@ -483,7 +523,7 @@ Erlang语言的if如果没有condition为真，会抛出异常。
 	print_and_return_nullptr_if_check_fail(expr_in_else != nullptr, 
 		"failed to parse else expr in if_ast\n");
 
-	return build_ast<if_ast>(ast_loc, cond, expr_in_then, expr_in_else);
+	return build_ast<if_ast>(ast_loc, cond, expr_in_then, expr_in_else, hint);
 }
 
 /*
@@ -660,12 +700,13 @@ tring to continue\n");
 */
 void parser::prepare_builtin_operator()
 {
+//core_operator中的operator都只做算术运算，声明为const便于优化
 	const char* core_op_decl = "				\
-extern binary , 1 (left  right) 						\
-extern unary ! (v) 												\
-extern binary > 10 (LHS RHS)					 \
-extern binary | 5 (LHS RHS) 						\
-extern binary == 9 (LHS RHS) 						\
+extern const binary , 1 (left  right) 						\
+extern const unary ! (v) 												\
+extern const binary > 10 (LHS RHS)					 \
+extern const binary | 5 (LHS RHS) 						\
+extern const binary == 9 (LHS RHS) 						\
 ";
 	stringstream op_decl(core_op_decl);
 	auto lexer_stream = linked_lexer.get_input_stream();
@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+#include "symbol_order.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include "utils.h"
+
+namespace toy_compiler{
+using namespace std;
+
+static bool is_cold_function(const Function& func)
+{
+	return func.hasFnAttribute(Attribute::Cold)
+		|| func.getName().contains(".cold.");
+}
+
+/*
+静态估计分两步：
+1 BlockFrequencyInfo给出每个基本块相对于函数入口的执行频率，
+	函数自身的工作量是各基本块的指令数按频率加权的和，
+	调用点所在基本块的频率记录在调用边上
+2 按调用图的SCC自顶向下传播入口频率：没有其他函数调用的函数是入口，频率为1，
+	callee的入口频率是各个调用点的频率乘以caller的入口频率之和，
+	同一个SCC内的递归调用不参与传播
+函数的热度是入口频率乘以自身的工作量。优化后小的callee通常已经内联，
+它们的工作量计入了调用者，留下来的函数按照实际的调用关系排序。
+*/
+static void compute_static_hotness(Module& mod,
+	unordered_map<const Function*, double>& hotness)
+{
+	unordered_map<const Function*, double> work;
+	unordered_map<const Function*, vector<pair<const Function*, double>>> calls;
+	for (auto& func : mod)
+	{
+		if (func.isDeclaration())
+			continue;
+		DominatorTree dom_tree(func);
+		LoopInfo loop_info(dom_tree);
+		BranchProbabilityInfo prob_info(func, loop_info);
+		BlockFrequencyInfo freq_info(func, prob_info, loop_info);
+		double entry_freq = freq_info.getEntryFreq();
+		for (const auto& bb : func)
+		{
+			double block_freq = freq_info.getBlockFreq(&bb).getFrequency()
+				/ entry_freq;
+			work[&func] += block_freq * bb.size();
+			for (const auto& inst : bb)
+			{
+				auto call = dyn_cast<CallInst>(&inst);
+				if (call == nullptr)
+					continue;
+				const Function* callee = call->getCalledFunction();
+				if (callee == nullptr || callee->isDeclaration())
+					continue;
+				calls[&func].emplace_back(callee, block_freq);
+			}
+		}
+	}
+
+	//scc_iterator按照自底向上的顺序给出SCC，callee所在的SCC在前
+	CallGraph call_graph(mod);
+	vector<vector<const Function*>> sccs;
+	unordered_map<const Function*, size_t> scc_ids;
+	for (auto it = scc_begin(&call_graph); !it.isAtEnd(); ++it)
+	{
+		sccs.emplace_back();
+		for (auto node : *it)
+		{
+			const Function* func = node->getFunction();
+			if (func == nullptr || func->isDeclaration())
+				continue;
+			scc_ids[func] = sccs.size() - 1;
+			sccs.back().push_back(func);
+		}
+	}
+	unordered_map<const Function*, double> entry_freqs;
+	for (const auto& item : calls)
+	{
+		for (const auto& call : item.second)
+		{
+			if (scc_ids[item.first] != scc_ids[call.first])
+				entry_freqs[call.first] = 0;
+		}
+	}
+	for (const auto& func : mod)
+	{
+		if (!func.isDeclaration())
+			entry_freqs.emplace(&func, 1.0);
+	}
+	for (auto it = sccs.rbegin(); it != sccs.rend(); ++it)
+	{
+		for (auto func : *it)
+		{
+			for (const auto& call : calls[func])
+			{
+				if (scc_ids[call.first] != scc_ids[func])
+					entry_freqs[call.first] += entry_freqs[func] * call.second;
+			}
+		}
+	}
+	for (const auto& item : work)
+		hotness[item.first] = entry_freqs[item.first] * item.second;
+}
+
+vector<symbol_score> symbol_order::compute(Module& mod)
+{
+	vector<const Function*> funcs;
+	unordered_map<const Function*, double> hotness;
+	bool has_profile = false;
+	for (const auto& func : mod)
+	{
+		if (func.isDeclaration())
+			continue;
+		funcs.push_back(&func);
+		if (auto count = func.getEntryCount(); count.hasValue())
+		{
+			has_profile = true;
+			hotness[&func] = count.getCount();
+		}
+	}
+	if (!has_profile)
+		compute_static_hotness(mod, hotness);
+
+	auto get_hotness = [&] (const Function* func)
+	{
+		auto it = hotness.find(func);
+		return it != hotness.cend() ? it->second : 0.0;
+	};
+	//module中的顺序作为最后的排序依据，保证结果确定
+	stable_sort(funcs.begin(), funcs.end(),
+		[&] (const Function* a, const Function* b)
+		{
+			bool a_cold = is_cold_function(*a);
+			bool b_cold = is_cold_function(*b);
+			if (a_cold != b_cold)
+				return b_cold;
+			return get_hotness(a) > get_hotness(b);
+		});
+
+	vector<symbol_score> symbols;
+	for (auto func : funcs)
+	{
+		symbols.push_back({func->getName().str(),
+			is_cold_function(*func) ? COLD_SCORE : get_hotness(func)});
+	}
+	return symbols;
+}
+
+bool symbol_order::write(const vector<symbol_score>& symbols,
+	const string& file_name)
+{
+	std::error_code err;
+	raw_fd_ostream out_stream(file_name, err);
+	if (err)
+	{
+		err_print(false, "can not open %s, reason:%s\n",
+			file_name.c_str(), err.message().c_str());
+		return false;
+	}
+	for (const auto& symbol : symbols)
+		out_stream << format("%.6e", symbol.score) << " " << symbol.name << "\n";
+	return true;
+}
+
+}	//end of toy_compiler
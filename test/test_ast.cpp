@@ -449,4 +449,37 @@ var_ast的结果又最终作为函数返回值。
 
 	ASSERT_EQ(var_body_bin->get_lhs()->get_type(), FOR_AST);
 	ASSERT_EQ(var_body_bin->get_rhs()->get_type(), VARIABLE_AST);
-}
\ No newline at end of file
+}
+TEST(test_ast, extern_purity)
+{
+	//读取string作为输入
+	prepare_parser_for_test_string tdef(
+		"extern pure f(x) extern const g(x) extern nounwind h(x) extern k(x)");
+	auto& ast_vec = tdef.get_ast_vec();
+	ASSERT_TRUE(ast_vec.size() == 4);
+	const func_purity expected[] =
+		{PURITY_PURE, PURITY_CONST, PURITY_NOUNWIND, PURITY_NONE};
+	for (size_t i = 0; i < ast_vec.size(); ++i)
+	{
+		ASSERT_TRUE(ast_vec[i]->get_type() == PROTOTYPE_AST);
+		auto proto = static_cast<prototype_ast *>(ast_vec[i].get());
+		ASSERT_TRUE(proto->get_purity() == expected[i]);
+	}
+}
+
+TEST(test_ast, if_hint)
+{
+	//读取string作为输入
+	prepare_parser_for_test_string tdef(
+		"def foo(x) if unlikely x < 0 then 0 else if likely x < 10 then x else 10");
+	auto& ast_vec = tdef.get_ast_vec();
+	function_ast* func_ptr = static_cast<function_ast *> (ast_vec[0].get());
+	expr_ast*  body = func_ptr->get_body().get();
+	ASSERT_TRUE(body->get_type() == IF_AST);
+	if_ast* outer_if = static_cast<if_ast *>(body);
+	ASSERT_TRUE(outer_if->get_hint() == BRANCH_HINT_UNLIKELY);
+	ASSERT_TRUE(outer_if->get_cond()->get_type() == BINARY_OPERATOR_AST);
+	ASSERT_TRUE(outer_if->get_else()->get_type() == IF_AST);
+	if_ast* inner_if = static_cast<if_ast *>(outer_if->get_else().get());
+	ASSERT_TRUE(inner_if->get_hint() == BRANCH_HINT_LIKELY);
+}
@@ -2,6 +2,12 @@
 #include "lexer.h"
 #include "parser.h"
 #include "llvm_ir_codegen.h"
+#include "llvm/DebugInfo/DWARF/DWARFContext.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"	//for FileRemover
+#include "llvm/Support/Path.h"
 #include "test_utils.h"
 #include <gtest/gtest.h>
 using namespace toy_compiler;
@@ -85,4 +91,428 @@ TEST(test_llvm_codegen, codegen_var_and_for)
     string tmpout;
     code_generator.print_IR_to_str(tmpout);
 	ASSERT_TRUE(1);
-}
\ No newline at end of file
+}
+TEST(test_llvm_codegen, codegen_branch_cond)
+{
+	//作为分支条件的比较直接生成i1，不再有uitofp和与0.0的比较
+	prepare_parser_for_test_string tdef(
+"extern binary > 10 (LHS RHS)						"
+"def min(x y) if x < y then x else y					"
+"def max(x y) if x > y then x else y					"
+"def lt(x y) x < y												"
+);
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Module* module = code_generator.get_module();
+	string min_ir, max_ir, lt_ir;
+	raw_string_ostream min_out(min_ir), max_out(max_ir), lt_out(lt_ir);
+	module->getFunction("min")->print(min_out);
+	module->getFunction("max")->print(max_out);
+	module->getFunction("lt")->print(lt_out);
+	min_out.flush();
+	max_out.flush();
+	lt_out.flush();
+	ASSERT_TRUE(min_ir.find("fcmp ult") != string::npos);
+	ASSERT_TRUE(min_ir.find("uitofp") == string::npos);
+	ASSERT_TRUE(min_ir.find("fcmp one") == string::npos);
+	//extern声明的core operator >直接展开，不再call
+	ASSERT_TRUE(max_ir.find("fcmp ugt") != string::npos);
+	ASSERT_TRUE(max_ir.find("_binary_>") == string::npos);
+	//比较结果作为数值使用时仍然需要转为double
+	ASSERT_TRUE(lt_ir.find("uitofp") != string::npos);
+}
+
+TEST(test_llvm_codegen, codegen_if_select)
+{
+	//简单无副作用的分支生成select，有call的分支仍然生成跳转
+	prepare_parser_for_test_string tdef(
+"extern kout(x)															"
+"def min(x y) if x < y then x else y					"
+"def show(x y) if x < y then kout(x) else y		"
+);
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Module* module = code_generator.get_module();
+	string min_ir, show_ir;
+	raw_string_ostream min_out(min_ir), show_out(show_ir);
+	module->getFunction("min")->print(min_out);
+	module->getFunction("show")->print(show_out);
+	min_out.flush();
+	show_out.flush();
+	ASSERT_TRUE(min_ir.find("select") != string::npos);
+	ASSERT_TRUE(min_ir.find("phi") == string::npos);
+	ASSERT_TRUE(show_ir.find("select") == string::npos);
+	ASSERT_TRUE(show_ir.find("phi") != string::npos);
+}
+
+TEST(test_llvm_codegen, codegen_fast_math)
+{
+	//fastmath修饰的函数带上fast math flags，其他函数跟随全局设置(默认strict)
+	prepare_parser_for_test_string tdef(
+"def fastmath fmad(x y z) x*y+z							"
+"def strict smad(x y z) x*y+z									"
+);
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Module* module = code_generator.get_module();
+	Function* fmad = module->getFunction("fmad");
+	Function* smad = module->getFunction("smad");
+	string fmad_ir, smad_ir;
+	raw_string_ostream fmad_out(fmad_ir), smad_out(smad_ir);
+	fmad->print(fmad_out);
+	smad->print(smad_out);
+	fmad_out.flush();
+	smad_out.flush();
+	ASSERT_TRUE(fmad_ir.find("fmul fast") != string::npos);
+	ASSERT_TRUE(fmad->getFnAttribute("unsafe-fp-math").getValueAsString()
+		== "true");
+	ASSERT_TRUE(smad_ir.find("fast") == string::npos);
+	ASSERT_FALSE(smad->hasFnAttribute("unsafe-fp-math"));
+}
+
+TEST(test_llvm_codegen, codegen_math_intrinsic)
+{
+	//extern的数学函数映射为intrinsic，其他extern保持普通call
+	prepare_parser_for_test_string tdef(
+"extern sin(x)																"
+"extern pow(x y)															"
+"extern kout(x)																"
+"def foo(x) kout(sin(x) + pow(x 2))						"
+);
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	string foo_ir;
+	raw_string_ostream foo_out(foo_ir);
+	code_generator.get_module()->getFunction("foo")->print(foo_out);
+	foo_out.flush();
+	ASSERT_TRUE(foo_ir.find("@llvm.sin.f64") != string::npos);
+	ASSERT_TRUE(foo_ir.find("@llvm.pow.f64") != string::npos);
+	ASSERT_TRUE(foo_ir.find("@kout") != string::npos);
+	ASSERT_TRUE(foo_ir.find("@sin(") == string::npos);
+}
+
+TEST(test_llvm_codegen, codegen_extern_purity)
+{
+	//pure/const修饰的extern声明带上对应的函数属性
+	prepare_parser_for_test_string tdef(
+"extern pure f(x)															"
+"extern const g(x)														"
+"extern k(x)																	"
+);
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Module* module = code_generator.get_module();
+	Function* f = module->getFunction("f");
+	Function* g = module->getFunction("g");
+	Function* k = module->getFunction("k");
+	ASSERT_TRUE(f->onlyReadsMemory() && !f->doesNotAccessMemory());
+	ASSERT_TRUE(f->doesNotThrow());
+	ASSERT_TRUE(g->doesNotAccessMemory() && g->doesNotThrow());
+	ASSERT_TRUE(g->hasFnAttribute(Attribute::WillReturn));
+	ASSERT_FALSE(k->onlyReadsMemory() || k->doesNotThrow());
+}
+
+TEST(test_llvm_codegen, codegen_inferred_func_attr)
+{
+	//只做算术和调用const函数的def被推导为readnone，递归和循环不保证返回
+	prepare_parser_for_test_string tdef(
+"extern const sq(x)														"
+"extern kout(x)																"
+"def add(x y) x + sq(y)												"
+"def fact(n) if n < 2 then 1 else n * fact(n - 1)		"
+"def loop(n) for i = 0 : i < n in add(i n)				"
+"def show(x) kout(add(x x))										"
+);
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Module* module = code_generator.get_module();
+	Function* add = module->getFunction("add");
+	Function* fact = module->getFunction("fact");
+	Function* loop = module->getFunction("loop");
+	Function* show = module->getFunction("show");
+	ASSERT_TRUE(add->doesNotAccessMemory() && add->doesNotThrow());
+	ASSERT_TRUE(add->hasFnAttribute(Attribute::WillReturn));
+	ASSERT_FALSE(add->doesNotRecurse());
+	ASSERT_TRUE(fact->doesNotAccessMemory());
+	ASSERT_FALSE(fact->doesNotRecurse());
+	ASSERT_FALSE(fact->hasFnAttribute(Attribute::WillReturn));
+	ASSERT_TRUE(loop->doesNotAccessMemory());
+	ASSERT_FALSE(loop->hasFnAttribute(Attribute::WillReturn));
+	ASSERT_FALSE(show->onlyReadsMemory() || show->doesNotThrow());
+}
+
+TEST(test_llvm_codegen, codegen_tail_call)
+{
+	//自递归尾调用改为循环，签名一致的尾调用标记musttail
+	prepare_parser_for_test_string tdef(
+"extern kout(x)																"
+"def sum(n acc) if n < 1 then acc else sum(n - 1 acc + n)	"
+"def twice(x) x * 2														"
+"def quad(x) twice(twice(x))										"
+"def show(x y) kout(x)												"
+);
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Module* module = code_generator.get_module();
+	string sum_ir, quad_ir, show_ir;
+	raw_string_ostream sum_out(sum_ir), quad_out(quad_ir), show_out(show_ir);
+	module->getFunction("sum")->print(sum_out);
+	module->getFunction("quad")->print(quad_out);
+	module->getFunction("show")->print(show_out);
+	sum_out.flush();
+	quad_out.flush();
+	show_out.flush();
+	ASSERT_TRUE(sum_ir.find("tailrecurse") != string::npos);
+	ASSERT_TRUE(sum_ir.find("call double @sum") == string::npos);
+	//只有外层的twice处于尾调用位置
+	ASSERT_TRUE(quad_ir.find("musttail call") != string::npos);
+	ASSERT_TRUE(quad_ir.find("musttail") == quad_ir.rfind("musttail"));
+	//签名不同只能标记tail
+	ASSERT_TRUE(show_ir.find("tail call") != string::npos);
+	ASSERT_TRUE(show_ir.find("musttail") == string::npos);
+}
+
+TEST(test_llvm_codegen, codegen_whole_program)
+{
+	//whole_program模式下只有main和export的函数保持外部可见
+	flag_guard whole_program_guard(global_flags.whole_program.flag_val, true);
+	prepare_parser_for_test_string tdef(
+"extern kout(x)																"
+"def helper(x) x * 2													"
+"def export api(x) helper(x) + 1							"
+"def main() kout(api(helper(1)))							"
+);
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Module* module = code_generator.get_module();
+	Function* helper = module->getFunction("helper");
+	Function* api = module->getFunction("api");
+	ASSERT_TRUE(helper->hasInternalLinkage());
+	ASSERT_TRUE(helper->getCallingConv() == CallingConv::Fast);
+	ASSERT_TRUE(api->hasExternalLinkage());
+	ASSERT_TRUE(module->getFunction("main")->hasExternalLinkage());
+	ASSERT_TRUE(module->getFunction("kout")->hasExternalLinkage());
+	//调用处的调用约定与callee一致
+	for (auto& inst : instructions(api))
+	{
+		if (auto call = dyn_cast<CallInst>(&inst);
+			call && call->getCalledFunction() == helper)
+		{
+			ASSERT_TRUE(call->getCallingConv() == CallingConv::Fast);
+		}
+	}
+}
+
+TEST(test_llvm_codegen, codegen_branch_weights)
+{
+	//带概率提示的if保留分支，并附上branch weights
+	prepare_parser_for_test_string tdef(
+"def clamp(x) if unlikely x < 0 then 0 else x				"
+);
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	string clamp_ir;
+	code_generator.print_IR_to_str(clamp_ir);
+	ASSERT_TRUE(clamp_ir.find("select") == string::npos);
+	ASSERT_TRUE(clamp_ir.find("!prof") != string::npos);
+	ASSERT_TRUE(clamp_ir.find("i32 1, i32 2000") != string::npos);
+}
+
+TEST(test_llvm_codegen, codegen_lifetime_marker)
+{
+	//前后两个var作用域不重叠，每个变量都有成对的lifetime标记
+	prepare_parser_for_test_string tdef(
+"def binary , 1 (left  right) right								"
+"def seq(x)																"
+"	(var a = x * 2 in a + 1) ,									"
+"	(var b = x * 3 in b + 1) ,									"
+"	for i = 0 : i < x in 0											"
+);
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	string seq_ir;
+	raw_string_ostream seq_out(seq_ir);
+	code_generator.get_module()->getFunction("seq")->print(seq_out);
+	seq_out.flush();
+	ASSERT_TRUE(seq_ir.find("llvm.lifetime.start") != string::npos);
+	ASSERT_TRUE(seq_ir.find("llvm.lifetime.end") != string::npos);
+	size_t start_count = 0, end_count = 0;
+	for (size_t pos = 0; (pos = seq_ir.find("call void @llvm.lifetime.start", pos))
+		!= string::npos; ++pos)
+		++start_count;
+	for (size_t pos = 0; (pos = seq_ir.find("call void @llvm.lifetime.end", pos))
+		!= string::npos; ++pos)
+		++end_count;
+	//a、b和循环变量i
+	ASSERT_EQ(start_count, 3u);
+	ASSERT_EQ(end_count, 3u);
+}
+
+TEST(test_llvm_codegen, codegen_debug_info_level)
+{
+	//line tables级别只保留行号和subprogram，不声明变量
+	flag_guard debug_info_guard(global_flags.debug_info.flag_val,
+		DEBUG_INFO_LINE_TABLES);
+	prepare_parser_for_test_string tdef(
+"def foo(x) var a = x + 1 in a * 2						"
+"def bar(x y) foo(x) + y										"
+);
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	string line_ir;
+	code_generator.print_IR_to_str(line_ir);
+	ASSERT_TRUE(line_ir.find("LineTablesOnly") != string::npos);
+	ASSERT_TRUE(line_ir.find("llvm.dbg.declare") == string::npos);
+	ASSERT_TRUE(line_ir.find("DILocalVariable") == string::npos);
+	ASSERT_TRUE(line_ir.find("!dbg") != string::npos);
+	//两个函数入参个数不同，但共用同一个空的subroutine type
+	size_t pos = line_ir.find("DISubroutineType");
+	ASSERT_TRUE(pos != string::npos);
+	ASSERT_TRUE(line_ir.find("DISubroutineType", pos + 1) == string::npos);
+
+	global_flags.debug_info.flag_val = DEBUG_INFO_FULL;
+	LLVM_IR_code_generator full_generator;
+	ASSERT_TRUE(full_generator.codegen(ast_vec));
+	string full_ir;
+	full_generator.print_IR_to_str(full_ir);
+	ASSERT_TRUE(full_ir.find("llvm.dbg.declare") != string::npos);
+	ASSERT_TRUE(full_ir.find("DILocalVariable") != string::npos);
+}
+
+namespace toy_compiler{
+extern bool build_object(string& object_name, Module* module);
+}
+
+TEST(test_llvm_codegen, codegen_split_dwarf)
+{
+	prepare_parser_for_test_string tdef(
+"def foo(x) var a = x + 1 in a * 2						"
+"def bar(x y) foo(x) + y										"
+);
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+
+	SmallString<128> object_path;
+	ASSERT_FALSE(sys::fs::createTemporaryFile("toy_split_dwarf", "o",
+		object_path));
+	SmallString<128> dwo_path(object_path);
+	sys::path::replace_extension(dwo_path, "dwo");
+	string object_name = object_path.str().str();
+	flag_guard split_dwarf_guard(global_flags.split_dwarf.flag_val, true);
+	ASSERT_TRUE(build_object(object_name, code_generator.get_module()));
+	ASSERT_TRUE(sys::fs::exists(dwo_path));
+
+	auto object = object::ObjectFile::createObjectFile(object_path);
+	auto dwo = object::ObjectFile::createObjectFile(dwo_path);
+	sys::fs::remove(object_path);
+	sys::fs::remove(dwo_path);
+	ASSERT_TRUE((bool)object);
+	ASSERT_TRUE((bool)dwo);
+	auto has_section = [] (const object::ObjectFile& obj, StringRef name)
+	{
+		for (const auto& section : obj.sections())
+		{
+			Expected<StringRef> section_name = section.getName();
+			if (!section_name)
+			{
+				consumeError(section_name.takeError());
+				continue;
+			}
+			if (*section_name == name)
+				return true;
+		}
+		return false;
+	};
+	ASSERT_TRUE(has_section(*dwo->getBinary(), ".debug_info.dwo"));
+	ASSERT_FALSE(has_section(*object->getBinary(), ".debug_info.dwo"));
+
+	//object中只有一个没有子节点的skeleton unit，通过dwo_name指向.dwo
+	auto object_dwarf = DWARFContext::create(*object->getBinary());
+	ASSERT_EQ(object_dwarf->getNumCompileUnits(), 1u);
+	DWARFDie skeleton = object_dwarf->getUnitAtIndex(0)->getUnitDIE(false);
+	ASSERT_FALSE(skeleton.hasChildren());
+	ASSERT_TRUE(skeleton.find(dwarf::DW_AT_GNU_dwo_name).hasValue()
+		|| skeleton.find(dwarf::DW_AT_dwo_name).hasValue());
+	//函数和变量的调试信息都在dwo的unit中
+	auto dwo_dwarf = DWARFContext::create(*dwo->getBinary());
+	ASSERT_EQ(dwo_dwarf->getNumDWOCompileUnits(), 1u);
+	ASSERT_TRUE(dwo_dwarf->getDWOUnitAtIndex(0)->getUnitDIE(false).hasChildren());
+}
+
+TEST(test_llvm_codegen, codegen_deep_expr)
+{
+	//十万条语句的','序列形成同样深度的binary树，codegen和析构都不能递归
+	const int stmt_num = 100000;
+	string input = "def binary , 1 (left  right) right		def deep(x) ";
+	for (int i = 0; i < stmt_num; ++i)
+		input += "x = x + 1 , ";
+	input += "x";
+	prepare_parser_for_test_string tdef(input.c_str());
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Function* deep = code_generator.get_module()->getFunction("deep");
+	ASSERT_TRUE(deep != nullptr);
+	ASSERT_FALSE(deep->empty());
+	size_t add_num = 0;
+	for (const auto& inst : instructions(deep))
+		add_num += inst.getOpcode() == Instruction::FAdd;
+	ASSERT_EQ(add_num, (size_t)stmt_num);
+}
+
+TEST(test_llvm_codegen, codegen_unity_build)
+{
+	//两个源文件解析到同一个module，后一个文件直接调用前一个文件的函数
+	SmallString<128> first_path, second_path;
+	ASSERT_FALSE(sys::fs::createTemporaryFile("toy_unity_a", "k", first_path));
+	ASSERT_FALSE(sys::fs::createTemporaryFile("toy_unity_b", "k", second_path));
+	//断言失败提前返回时也删除临时文件
+	FileRemover first_remover(first_path), second_remover(second_path);
+	{
+		std::error_code err;
+		raw_fd_ostream first_out(first_path, err);
+		ASSERT_FALSE(err);
+		first_out << "def foo(x) x * 2\n";
+		raw_fd_ostream second_out(second_path, err);
+		ASSERT_FALSE(err);
+		second_out << "\ndef bar(x) foo(x) + 1\n";
+	}
+
+	lexer t_lexer(first_path.str().str());
+	ASSERT_TRUE(t_lexer.is_ok);
+	parser t_parser(t_lexer);
+	t_parser.parse();
+	ASSERT_TRUE(t_lexer.open_file(second_path.str().str()));
+	t_parser.parse();
+	const auto& ast_vec = t_parser.get_ast_vec();
+	ASSERT_EQ(ast_vec.size(), (size_t)2);
+
+	flag_guard debug_info_guard(global_flags.debug_info.flag_val,
+		DEBUG_INFO_LINE_TABLES);
+	LLVM_IR_code_generator code_generator(first_path.str());
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+
+	//每个源文件一个compile unit，函数的行号相对于自己的文件
+	Module* mod = code_generator.get_module();
+	ASSERT_EQ(mod->getNamedMetadata("llvm.dbg.cu")->getNumOperands(), 2u);
+	DISubprogram* foo_sp = mod->getFunction("foo")->getSubprogram();
+	DISubprogram* bar_sp = mod->getFunction("bar")->getSubprogram();
+	ASSERT_TRUE(foo_sp != nullptr && bar_sp != nullptr);
+	ASSERT_NE(foo_sp->getUnit(), bar_sp->getUnit());
+	ASSERT_EQ(foo_sp->getLine(), 1u);
+	ASSERT_EQ(bar_sp->getLine(), 2u);
+	ASSERT_EQ(sys::path::filename(bar_sp->getFilename()),
+		sys::path::filename(second_path));
+}
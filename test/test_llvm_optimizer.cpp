@@ -1,9 +1,18 @@
 #include <sstream>
+#include <chrono>
+#include <thread>
 #include "lexer.h"
 #include "parser.h"
 #include "llvm_ir_codegen.h"
 #include "llvm_optimizer.h"
+#include "opt_remarks.h"
+#include "symbol_order.h"
 #include "test_utils.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"	//for FileRemover
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include <gtest/gtest.h>
 using namespace toy_compiler;
 
@@ -57,3 +66,493 @@ TEST(test_llvm_optimizer, function_optimizer_extern)
 	ASSERT_TRUE(1);
 }
 
+
+TEST(test_llvm_optimizer, ast_attribution)
+{
+	//关闭调试信息，dbg.declare不经过ir_builder，不会有标签
+	flag_guard attribution_guard(global_flags.ast_attribution.flag_val, true);
+	flag_guard debug_info_guard(global_flags.debug_info.flag_val,
+		DEBUG_INFO_NONE);
+	prepare_parser_for_test_string tdef(
+"def foo(x y) var z = x * y in z + x * y			"
+"def bar(x) foo(x 2) + 1								"
+);
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Module* module = code_generator.get_module();
+	const auto& origins = code_generator.get_ast_origins();
+	auto before = ir_attribution::collect(*module, origins);
+	ASSERT_TRUE(before.total > 0);
+	ASSERT_EQ(before.unattributed, 0u);
+	ASSERT_EQ(before.per_function["foo"] + before.per_function["bar"],
+		before.total);
+	//没有调试信息时按照标签对应ast的文件和行号统计
+	for (const auto& item : before.per_line)
+	{
+		ASSERT_NE(item.first.second, 0);
+		ASSERT_FALSE(item.first.first.empty());
+	}
+	for (const auto& item : before.per_ast)
+		ASSERT_TRUE(origins.count(item.first) != 0);
+
+	llvm_optimizer::optimize_module(*module);
+	auto after = ir_attribution::collect(*module, origins);
+	ASSERT_TRUE(after.total < before.total);
+	string report;
+	raw_string_ostream report_out(report);
+	ir_attribution::print(after, origins, "after optimize", report_out);
+	report_out.flush();
+	ASSERT_TRUE(report.find("per ast node") != string::npos);
+}
+
+/*
+逐个函数优化的开销对比：每次调用optimize_function都会新建会话，
+复用一个llvm_optimizer会话只在构造时付出一次创建开销。
+两种方式的优化结果必须一致，耗时只打印不做断言，避免测试不稳定。
+*/
+TEST(test_llvm_optimizer, function_optimizer_session_bench)
+{
+	const int func_num = 200;
+	string input;
+	for (int i = 0; i < func_num; ++i)
+		input += "def f" + to_string(i) + "(x y) (x + y) * (x + y) + " +
+			to_string(i) + " ";
+	prepare_parser_for_test_string tdef(input.c_str());
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator one_shot_generator, session_generator;
+	ASSERT_TRUE(one_shot_generator.codegen(ast_vec));
+	ASSERT_TRUE(session_generator.codegen(ast_vec));
+
+	using clock = std::chrono::steady_clock;
+	auto start = clock::now();
+	for (auto& func : *one_shot_generator.get_module())
+		llvm_optimizer::optimize_function(func);
+	auto one_shot_time = clock::now() - start;
+
+	start = clock::now();
+	llvm_optimizer optimizer;
+	for (auto& func : *session_generator.get_module())
+		optimizer.optimize(func);
+	auto session_time = clock::now() - start;
+
+	using std::chrono::microseconds;
+	using std::chrono::duration_cast;
+	cout << "per function optimize: one shot "
+		<< duration_cast<microseconds>(one_shot_time).count() / func_num
+		<< "us, session "
+		<< duration_cast<microseconds>(session_time).count() / func_num
+		<< "us" << endl;
+
+	string one_shot_ir, session_ir;
+	one_shot_generator.print_IR_to_str(one_shot_ir);
+	session_generator.print_IR_to_str(session_ir);
+	ASSERT_EQ(one_shot_ir, session_ir);
+}
+
+TEST(test_llvm_optimizer, module_optimizer_session)
+{
+	//同一个会话连续优化多个module，分析结果不能串用
+	llvm_optimizer optimizer;
+	for (int i = 0; i < 3; ++i)
+	{
+		prepare_parser_for_test_string tdef(
+			"def foo(x y) var z = x + y in z * z		def bar(x) foo(x x)");
+		const auto& ast_vec = tdef.get_ast_vec();
+		LLVM_IR_code_generator code_generator;
+		ASSERT_TRUE(code_generator.codegen(ast_vec));
+		optimizer.optimize(*code_generator.get_module());
+		ASSERT_FALSE(verifyModule(*code_generator.get_module(), &errs()));
+	}
+}
+
+TEST(test_llvm_optimizer, custom_pipeline)
+{
+	prepare_parser_for_test_string tdef(
+		"def foo(x y) var z = x + y in z * z");
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Module* module = code_generator.get_module();
+	//错误的pipeline不修改module
+	ASSERT_FALSE(llvm_optimizer::optimize_module(*module, "function(no_such_pass)"));
+	ASSERT_TRUE(module->getFunction("foo")->getEntryBlock().front().getOpcode()
+		== Instruction::Alloca);
+	//只做mem2reg，局部变量都提升到寄存器
+	ASSERT_TRUE(llvm_optimizer::optimize_module(*module, "function(mem2reg)"));
+	string ir;
+	code_generator.print_IR_to_str(ir);
+	ASSERT_TRUE(ir.find("alloca") == string::npos);
+	ASSERT_FALSE(llvm_optimizer::is_valid_opt_level(6));
+}
+
+TEST(test_llvm_optimizer, pgo_instrument)
+{
+	//插桩后每个函数都有自己的计数器，并且会写出profile
+	prepare_parser_for_test_string tdef(
+		"def foo(x) if x < 1 then 1 else x * 2		def main() foo(3)");
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	flag_guard pgo_guard(global_flags.pgo.flag_val, 1);
+	llvm_optimizer optimizer;
+	optimizer.optimize(*code_generator.get_module(), 2);
+	string ir;
+	code_generator.print_IR_to_str(ir);
+	ASSERT_TRUE(ir.find("__profc_") != string::npos);
+	ASSERT_TRUE(ir.find("__llvm_profile") != string::npos);
+}
+
+TEST(test_llvm_optimizer, pgo_sample_use)
+{
+	//文本格式的sample profile：函数名:总采样数:入口采样数，之后是行号偏移:采样数
+	SmallString<128> profile_path;
+	ASSERT_FALSE(sys::fs::createTemporaryFile("toy_sample", "prof",
+		profile_path));
+	FileRemover profile_remover(profile_path);
+	{
+		std::error_code err;
+		raw_fd_ostream profile_out(profile_path, err);
+		ASSERT_FALSE(err);
+		profile_out << "foo:1000:100\n 0: 100\n";
+	}
+
+	flag_guard pgo_guard(global_flags.pgo.flag_val, 3);
+	flag_guard profile_guard(global_flags.profile_file.flag_val,
+		profile_path.str().str());
+	prepare_parser_for_test_string tdef(
+		"def foo(x) x * 2 + 1		def bar(x) foo(x) + 1");
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	llvm_optimizer optimizer;
+	Function* foo = code_generator.get_module()->getFunction("foo");
+	ASSERT_TRUE(foo->hasFnAttribute("use-sample-profile"));
+	optimizer.optimize(*code_generator.get_module(), 2);
+
+	//foo有采样数据，入口计数来自profile
+	foo = code_generator.get_module()->getFunction("foo");
+	ASSERT_TRUE(foo != nullptr);
+	ASSERT_TRUE(foo->getEntryCount().hasValue());
+}
+
+namespace toy_compiler{
+extern bool build_thin_lto_bitcode(string& object_name, Module* module);
+}
+
+TEST(test_llvm_optimizer, thin_lto_bitcode)
+{
+	prepare_parser_for_test_string tdef(
+		"def helper(x) x * 2		def foo(x) helper(x) + 1");
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Module* module = code_generator.get_module();
+	llvm_optimizer::optimize_module(*module, 2, true);
+
+	SmallString<128> object_path;
+	ASSERT_FALSE(sys::fs::createTemporaryFile("toy_thin_lto", "o",
+		object_path));
+	string object_name = object_path.str().str();
+	ASSERT_TRUE(build_thin_lto_bitcode(object_name, module));
+	auto buffer = MemoryBuffer::getFile(object_name);
+	ASSERT_TRUE((bool)buffer);
+	auto lto_info = getBitcodeLTOInfo((*buffer)->getMemBufferRef());
+	sys::fs::remove(object_path);
+	ASSERT_TRUE((bool)lto_info);
+	ASSERT_TRUE(lto_info->IsThinLTO);
+	ASSERT_TRUE(lto_info->HasSummary);
+}
+
+TEST(test_llvm_optimizer, opt_remarks_missed_inline)
+{
+	//big中有大量外部调用，内联代价超过阈值，user中的两次调用都不会被内联
+	string input = "extern ext(x)		def big(x) ";
+	for (int i = 0; i < 64; ++i)
+		input += "ext(x + " + to_string(i) + ") + ";
+	input += "x		def user(x) big(x) + big(x + 1)";
+	prepare_parser_for_test_string tdef(input.c_str());
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Module* module = code_generator.get_module();
+
+	SmallString<128> remark_path;
+	ASSERT_FALSE(sys::fs::createTemporaryFile("toy_remarks", "opt.yaml",
+		remark_path));
+	{
+		opt_remarks remarks(module->getContext());
+		ASSERT_FALSE(remarks.setup(remark_path.str().str(), "(", "yaml", false));
+		ASSERT_TRUE(remarks.setup(remark_path.str().str(), "inline", "yaml",
+			false));
+		llvm_optimizer::optimize_module(*module, 2);
+		ASSERT_GT(remarks.get_missed_num(), 0u);
+		const auto& summary = remarks.get_summary();
+		auto it = summary.find("user");
+		ASSERT_TRUE(it != summary.cend());
+		bool found_inline = false;
+		for (const auto& item : it->second)
+		{
+			found_inline = found_inline || item.first.find("missed inline:")
+				== 0;
+			//只保留inline相关pass的remarks
+			ASSERT_TRUE(item.first.find("inline") != string::npos);
+		}
+		ASSERT_TRUE(found_inline);
+		string out;
+		raw_string_ostream out_stream(out);
+		remarks.print_summary(out_stream);
+		ASSERT_TRUE(out_stream.str().find("user:") != string::npos);
+	}
+
+	auto buffer = MemoryBuffer::getFile(remark_path);
+	ASSERT_TRUE((bool)buffer);
+	string yaml = (*buffer)->getBuffer().str();
+	sys::fs::remove(remark_path);
+	ASSERT_TRUE(yaml.find("--- !Missed") != string::npos);
+	ASSERT_TRUE(yaml.find("Pass:            inline") != string::npos);
+}
+
+TEST(test_llvm_optimizer, adaptive_opt)
+{
+/*
+sq在两层循环中被调用，是小而热的函数；kernel只被调用一次，但其中有热循环；
+init很大且只调用一次，是大而冷的函数；entry同样很大，但没有调用者，是入口
+*/
+	string input = "def sq(x) x * x		def init(x) ";
+	for (int i = 0; i < 1500; ++i)
+		input += "x * " + to_string(i) + " + ";
+	input += "x		def entry(x) ";
+	for (int i = 0; i < 500; ++i)
+		input += "x * " + to_string(i) + " + ";
+	input += "x		"
+		"def kernel(n) var s = 0 in (for i = 0 : i < n in "
+		"for j = 0 : j < 40 in s = s + sq(j) * i) + s		"
+		"def run(n) init(n) + kernel(n)";
+	prepare_parser_for_test_string tdef(input.c_str());
+	const auto& ast_vec = tdef.get_ast_vec();
+	auto get_hot_size = [] (Module& mod)
+	{
+		size_t size = 0;
+		for (const char* name : {"sq", "kernel", "run"})
+		{
+			if (Function* func = mod.getFunction(name))
+				size += func->getInstructionCount();
+		}
+		return size;
+	};
+
+	{
+		LLVM_IR_code_generator code_generator;
+		ASSERT_TRUE(code_generator.codegen(ast_vec));
+		Module* module = code_generator.get_module();
+		llvm_optimizer optimizer;
+		auto decisions = optimizer.optimize_adaptive(*module, 2);
+		ASSERT_FALSE(verifyModule(*module, &errs()));
+		ASSERT_EQ(decisions["sq"].tier, TIER_HOT);
+		ASSERT_EQ(decisions["kernel"].tier, TIER_HOT);
+		ASSERT_EQ(decisions["init"].tier, TIER_SIZE);
+		ASSERT_EQ(decisions["entry"].tier, TIER_DEFAULT);
+		//sq内联到kernel、kernel内联到run后，热循环都在调用者中
+		ASSERT_TRUE(decisions["kernel"].hot_loops);
+		ASSERT_TRUE(decisions["run"].hot_loops);
+		ASSERT_FALSE(decisions["init"].hot_loops);
+		Function* init = module->getFunction("init");
+		ASSERT_TRUE(init != nullptr);
+		ASSERT_TRUE(init->hasFnAttribute(Attribute::MinSize));
+		ASSERT_TRUE(init->hasFnAttribute(Attribute::OptimizeForSize));
+
+		//O3的展开阈值下，40次的内层循环被完全展开，O2不会展开
+		LLVM_IR_code_generator o2_generator;
+		ASSERT_TRUE(o2_generator.codegen(ast_vec));
+		llvm_optimizer::optimize_module(*o2_generator.get_module(), 2);
+		ASSERT_GT(get_hot_size(*module), get_hot_size(*o2_generator.get_module()));
+	}
+
+	//预算只够小函数使用，超出预算的巨型函数不做优化
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Module* module = code_generator.get_module();
+	llvm_optimizer optimizer;
+	auto decisions = optimizer.optimize_adaptive(*module, 2, 200);
+	ASSERT_FALSE(verifyModule(*module, &errs()));
+	ASSERT_EQ(decisions["sq"].tier, TIER_HOT);
+	ASSERT_EQ(decisions["init"].tier, TIER_NONE);
+	Function* init = module->getFunction("init");
+	ASSERT_TRUE(init->hasFnAttribute(Attribute::OptimizeNone));
+	ASSERT_TRUE(init->hasFnAttribute(Attribute::NoInline));
+	//optnone的函数保留了codegen生成的alloca
+	ASSERT_TRUE(init->getEntryBlock().front().getOpcode() == Instruction::Alloca);
+}
+
+TEST(test_llvm_optimizer, parallel_module_optimize_bench)
+{
+	//许多松散相连的函数：每个函数有一个循环，并调用前一个函数
+	const int func_num = 400;
+	string input = "def f0(x) x ";
+	for (int i = 1; i < func_num; ++i)
+		input += "def f" + to_string(i) + "(x) var s = 0 in "
+			"(for i = 0 : i < x in s = s + i * " + to_string(i) + ") + f"
+			+ to_string(i - 1) + "(s) ";
+	prepare_parser_for_test_string tdef(input.c_str());
+	const auto& ast_vec = tdef.get_ast_vec();
+
+	using clock = std::chrono::steady_clock;
+	using std::chrono::milliseconds;
+	using std::chrono::duration_cast;
+	unsigned max_jobs = std::max(2u, std::min(8u, std::thread::hardware_concurrency()));
+	//jobs为1时经过同样的内联、分区和bitcode往返，耗时可以直接对比
+	for (unsigned jobs = 1; jobs <= max_jobs; jobs *= 2)
+	{
+		LLVM_IR_code_generator code_generator;
+		ASSERT_TRUE(code_generator.codegen(ast_vec));
+		Module* module = code_generator.get_module();
+		auto start = clock::now();
+		ASSERT_TRUE(llvm_optimizer::optimize_module_parallel(*module, 2, jobs));
+		auto elapsed = clock::now() - start;
+		cout << "parallel optimize " << func_num << " functions with " << jobs
+			<< " jobs: " << duration_cast<milliseconds>(elapsed).count()
+			<< "ms" << endl;
+		ASSERT_FALSE(verifyModule(*module, &errs()));
+		Function* last = module->getFunction("f" + to_string(func_num - 1));
+		ASSERT_TRUE(last != nullptr && !last->isDeclaration());
+		//各个分区的compile unit合并为一份，所有函数都指向它
+		auto cu_list = module->getNamedMetadata("llvm.dbg.cu");
+		ASSERT_EQ(cu_list->getNumOperands(), 1u);
+		for (const auto& func : *module)
+		{
+			auto sub_prog = func.getSubprogram();
+			ASSERT_TRUE(sub_prog == nullptr
+				|| sub_prog->getUnit() == cu_list->getOperand(0));
+		}
+		if (jobs == 1)
+			continue;
+
+		//同样的分区数，结果必须完全一致
+		LLVM_IR_code_generator again_generator;
+		ASSERT_TRUE(again_generator.codegen(ast_vec));
+		ASSERT_TRUE(llvm_optimizer::optimize_module_parallel(
+			*again_generator.get_module(), 2, jobs));
+		string ir, again_ir;
+		code_generator.print_IR_to_str(ir);
+		again_generator.print_IR_to_str(again_ir);
+		ASSERT_EQ(ir, again_ir);
+	}
+}
+
+namespace toy_compiler{
+extern bool get_module_text_size(Module* module, uint64_t& text_size,
+	bool machine_outliner);
+}
+
+TEST(test_llvm_optimizer, size_opt)
+{
+	//生成的代码中有许多相同的函数
+	const int func_num = 8;
+	string input, user = "def user(x) 0";
+	for (int i = 0; i < func_num; ++i)
+	{
+		string name = "g" + to_string(i);
+		input += "def " + name + "(x) var s = 0 in "
+			"(for i = 0 : i < x in s = s + i * i) + s * 3		";
+		user += " + " + name + "(x)";
+	}
+	input += user;
+	prepare_parser_for_test_string tdef(input.c_str());
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Module* module = code_generator.get_module();
+	auto baseline = CloneModule(*module);
+
+	llvm_optimizer optimizer;
+	ASSERT_TRUE(optimizer.optimize_size(*module));
+	ASSERT_FALSE(verifyModule(*module, &errs()));
+	size_t thunk_num = 0;
+	for (const auto& func : *module)
+	{
+		if (func.isDeclaration())
+			continue;
+		ASSERT_TRUE(func.hasMinSize());
+		//被合并的函数只剩下对保留函数的调用
+		thunk_num += func.getInstructionCount() <= 3;
+	}
+	ASSERT_EQ(thunk_num, (size_t)func_num - 1);
+
+	//测试进程没有设置-enable-machine-outliner=always，x86上的减少来自mergefunc和minsize
+	uint64_t text_size, baseline_size;
+	auto size_module = CloneModule(*module);
+	ASSERT_TRUE(get_module_text_size(size_module.get(), text_size, true));
+	llvm_optimizer::optimize_module(*baseline, 2);
+	ASSERT_TRUE(get_module_text_size(baseline.get(), baseline_size, false));
+	cout << "text size: size_opt " << text_size << " bytes, O2 "
+		<< baseline_size << " bytes" << endl;
+	ASSERT_LT(text_size, baseline_size);
+}
+
+TEST(test_llvm_optimizer, symbol_order)
+{
+/*
+work和rare都足够大，O2不会内联：work在循环中每次都调用，rare只在unlikely的分支中调用。
+kernel没有调用者，是入口。module中rare排在最前，排序结果不能只是module的顺序
+*/
+	string rare = "def rare(x) x", work = "def work(x) x";
+	for (int i = 1; i < 300; ++i)
+	{
+		rare += " + x * " + to_string(i);
+		work += " + x * " + to_string(i + 1000);
+	}
+	string input = rare + "		" + work + "		"
+"def kernel(n) var s = 0 in										"
+"	(for i = 0 : i < n in											"
+"		s = s + work(i) + (if unlikely n < s then rare(i) * i + rare(s) * s else 0)) + s	";
+	prepare_parser_for_test_string tdef(input.c_str());
+	const auto& ast_vec = tdef.get_ast_vec();
+	LLVM_IR_code_generator code_generator;
+	ASSERT_TRUE(code_generator.codegen(ast_vec));
+	Module* module = code_generator.get_module();
+	llvm_optimizer::optimize_module(*module, 2);
+
+	auto index_of = [] (const vector<symbol_score>& symbols, const string& name)
+	{
+		return find_if(symbols.begin(), symbols.end(),
+			[&] (const symbol_score& symbol) {return symbol.name == name;})
+			- symbols.begin();
+	};
+	auto symbols = symbol_order::compute(*module);
+	ASSERT_EQ(symbols.size(), 3u);
+	ASSERT_LT(index_of(symbols, "work"), index_of(symbols, "rare"));
+	ASSERT_LT(index_of(symbols, "kernel"), index_of(symbols, "rare"));
+
+	//rare标记为cold后，kernel中调用它的分支被拆分为kernel.cold.1，两者都排在最后
+	module->getFunction("rare")->addFnAttr(Attribute::Cold);
+	ASSERT_TRUE(llvm_optimizer::optimize_module(*module, "hotcoldsplit"));
+	ASSERT_FALSE(verifyModule(*module, &errs()));
+	Function* cold_part = module->getFunction("kernel.cold.1");
+	ASSERT_TRUE(cold_part != nullptr && !cold_part->isDeclaration());
+	symbols = symbol_order::compute(*module);
+	ASSERT_EQ(symbols.size(), 4u);
+	ASSERT_GE(index_of(symbols, "rare"), 2);
+	ASSERT_GE(index_of(symbols, "kernel.cold.1"), 2);
+	ASSERT_EQ(symbols[3].score, symbol_order::COLD_SCORE);
+
+	SmallString<128> order_path;
+	ASSERT_FALSE(sys::fs::createTemporaryFile("toy_symbol", "order",
+		order_path));
+	ASSERT_TRUE(symbol_order::write(symbols, order_path.str().str()));
+	auto buffer = MemoryBuffer::getFile(order_path);
+	sys::fs::remove(order_path);
+	ASSERT_TRUE((bool)buffer);
+	//每行是分数和符号，compiler.sh按第一列合并多个文件
+	SmallVector<StringRef, 4> lines;
+	(*buffer)->getBuffer().split(lines, '\n', -1, false);
+	ASSERT_EQ(lines.size(), 4u);
+	for (size_t i = 0; i < lines.size(); ++i)
+	{
+		auto fields = lines[i].split(' ');
+		double score;
+		ASSERT_FALSE(fields.first.getAsDouble(score));
+		ASSERT_EQ(fields.second, symbols[i].name);
+	}
+	ASSERT_TRUE(lines.back().startswith("-1"));
+}
@@ -25,4 +25,25 @@ public:
 	auto& get_ast_vec() const {return test_parser.get_ast_vec();}
 };
 
+/*
+测试中临时修改global_flags中的flag，析构时恢复原值。
+断言失败提前返回时也会恢复，不影响后面的测试。
+*/
+template <typename T>
+class flag_guard
+{
+	T& flag_val;
+	T saved_val;
+
+public:
+	template <typename V>
+	flag_guard(T& flag, V new_val) : flag_val(flag), saved_val(flag)
+	{
+		flag_val = new_val;
+	}
+	~flag_guard() {flag_val = saved_val;}
+	flag_guard(const flag_guard&) = delete;
+	flag_guard& operator=(const flag_guard&) = delete;
+};
+
 }